@@ -57,6 +57,7 @@
 #include <string.h>
 #include <time.h>
 #include <ctype.h>
+#include <math.h>
 
 #if defined(_MSC_VER)
   // Compiling for Windows.
@@ -73,6 +74,7 @@
   #include <pthread.h>
   #include <stdbool.h>
   #include <stdint.h>
+  #include <dlfcn.h>
 #endif
 
 /*---------------------------------------------------------------------------*/
@@ -88,14 +90,38 @@
 #define DEFAULT_LEVEL		61
 #define DEFAULT_MAX_ROUNDS	500
 #define DEFAULT_THREADS		8
+#define DEFAULT_EXACT_LIMIT	1000000
+#define MAX_STRATA		10000
+#define PILOT_PERCENT		10
+#define DEFAULT_FORK_LIMIT	10000
+#define MAX_FORK_DEPTH		150
+#define MAX_FORK_DRAWS		32
+#define MAX_FORK_WIDTH		64
+#define MAX_CYCLE_ROUNDS	8
+#define FIRST_CYCLE_ROUND	16
+#define CYCLE_WINDOW		5
+#define FIRST_UNAVOIDABLE_ROUND	51
+#define DEFAULT_SOLVE_LIMIT	100000
+#define NUM_LANES		16
+#define WINDOW_BINS		1024
+#define NUM_EST_FEATURES	3
+#define DEFAULT_BOUND_SLACK	25
+#define ENUM_BATCH		500
+#define ENUM_TOP		10
+#define MAX_CORPUS		200
+#define COMPARE_ALPHA		0.01
 
 #define MAX_ATTR		40
+#define MAX_ATTR_LEVEL		32767
 #define MAX_RUNES		4
 #define MAX_CARDS_IN_SET	20
 #define MAX_CARDS_IN_DECK	10
 #define MAX_CARD_TYPES		1000
 #define MAX_CARDS_IN_HAND	5
 #define MAX_THREADS		64
+#define MAX_CANDIDATES		200
+#define MAX_PACKED_EXTRA	6
+#define NAME_INDEX_SIZE		4096	// Power of 2, over twice the names.
 
 #define SET_HAND	1
 #define SET_FIELD	2
@@ -103,6 +129,10 @@
 
 #define MAX_LINE_SIZE	4096
 
+#if !defined(M_PI)
+#define M_PI		3.14159265358979323846
+#endif
+
 #define dprintf(fmt, ...) \
     do { if (doDebug) {fprintf(output, fmt, ## __VA_ARGS__);} } while (0)
 
@@ -120,10 +150,43 @@ static bool        doAppend;
 static bool        verbose;
 static bool        showDamage;
 static bool        avgConcentrate;
+static bool        doSensitivity;
+static bool        doCompile;
+static bool        doExact;
+static bool        doNeyman;
+static bool        doAntithetic;
+static bool        doControlVariates;
+static bool        doFork;
+static bool        doSolve;
+static bool        noCycles;
+static bool        noLanes;
+static bool        fullShuffle;
+static bool        doTilt;
+static int         tailDamage;
+static int         stratifyCards;
+static int         windowMinutes;
+static const char *estimateFile;
+static const char *calibrateFile;
+static int         enumerateCards;
+static int         maxCost;
+static int         boundSlack = DEFAULT_BOUND_SLACK;
+static bool        doCompare;
+static const char *corpusFile;
 static const char *outputFilename;
 static const char *deckFile = "deck.txt";
+static const char *candidatesFile;
 static int         numIters = DEFAULT_ITERS;
 static int         numThreads = 8;
+static int         exactLimit = DEFAULT_EXACT_LIMIT;
+static int         forkLimit = DEFAULT_FORK_LIMIT;
+static int         solveLimit = DEFAULT_SOLVE_LIMIT;
+static unsigned int runSeed;
+static bool        haveSeed;
+static const char *snapshotFile;
+static const char *saveFile;
+static int         saveRound;
+static bool        haveHp;
+static bool        haveDemon;
 
 // Initial state:
 static int initialLevel = DEFAULT_LEVEL;
@@ -137,6 +200,15 @@ static int         numRunes;
 
 static const char *theDemon = "DarkTitan";
 
+// Cards and runes to try as substitutes in the sensitivity analysis.
+static const char *theCandidates[MAX_CANDIDATES];
+static int         numCandidates;
+
+// Demons and decks to run -compare on.
+static const char *theCorpusDemons[MAX_CORPUS];
+static const char *theCorpusDecks[MAX_CORPUS];
+static int         numCorpus;
+
 // This is the big list of attributes that are supported (i.e. abilities).
 enum attrTypes {
     ATTR_NONE,
@@ -230,16 +302,30 @@ enum attrTypes {
     ATTR_DIRT,
     ATTR_FLYING_STONE,
     ATTR_TSUNAMI,
+    NUM_ATTR_TYPES
 };
 
+#if defined(SIM_COMPILED)
+// When built by -compile (see RunCompiled), this lists the attributes that
+// can appear in the fights.  HasAttr() checks it first, so the code for the
+// other abilities is known to be dead at compile time and gets removed.
+static const unsigned char compiledAttrs[NUM_ATTR_TYPES] = COMPILED_ATTRS;
+typedef char compiledAttrsCheck[NUM_ATTR_TYPES == COMPILED_NUM_ATTR_TYPES ?
+				1 : -1];
+#endif
+
 // An attribute will have a type and an optional "level".  The level will be
 // either an amount or percent.  For example, "Dodge:60" will have a type
-// of ATTR_DODGE and a level of 60.
+// of ATTR_DODGE and a level of 60.  Both are kept small, since every card
+// has two arrays of them and they make up most of a State.  Levels read from
+// files are checked against MAX_ATTR_LEVEL.
 typedef struct attribute {
-    int		type;
-    int		level;
+    unsigned char	type;
+    short		level;
 } Attr;
 
+typedef char attrTypeCheck[NUM_ATTR_TYPES <= 256 ? 1 : -1];
+
 // The dead attribute is used to mark a card as dead so we can identify
 // a dead card that way instead of looking at the hit points.  Some cards
 // can "die" without losing all their hit points (e.g. exile).
@@ -254,11 +340,13 @@ const Attr DeadAttr = { ATTR_DEAD };
 typedef struct card {
     // Not changeable info.
     const char *name;
+    int		id;			// Index in cardTypes, -1 if none.
     int		cost;
     int		timing;
     int		baseAtk;
     int		baseHp;
     Attr	baseAttr[MAX_ATTR];
+    int		numBaseAttr;		// Used entries of baseAttr.
 
     // Current state.
     int		curTiming;
@@ -290,6 +378,78 @@ typedef struct rune {
     int		usedThisRound;
 } Rune;
 
+// Kinds of yes/no random decisions (see Chance()).
+enum rollTypes {
+    ROLL_DODGE,			// Dodge and nimble soul.
+    ROLL_CONCENTRATE,		// Concentrate and frost bite.
+    ROLL_TRAP,			// Demon trap.
+    ROLL_RESURRECT,		// Resurrection and dirt.
+    NUM_ROLL_TYPES
+};
+
+// Names of the roll types, for -tilt.
+static const char *rollNames[NUM_ROLL_TYPES] = {
+    "dodge",
+    "concentrate",
+    "trap",
+    "resurrect",
+};
+
+// Percentage points added to the chance of each roll type (-tilt).
+static int tiltPercent[NUM_ROLL_TYPES];
+
+// Engine switches that -compare can flip.  They change how the fights are
+// played out, but none of them should change the results, except for
+// avgconcentrate, which is there to check that -compare can tell.
+enum engineSwitches {
+    SWITCH_FULLSHUFFLE,
+    SWITCH_NOLANES,
+    SWITCH_NOCYCLES,
+    SWITCH_AVGCONCENTRATE,
+    NUM_SWITCHES
+};
+
+// Names of the switches, for -compare.
+static const char *switchNames[NUM_SWITCHES] = {
+    "fullshuffle",
+    "nolanes",
+    "nocycles",
+    "avgconcentrate",
+};
+
+static bool *switchFlags[NUM_SWITCHES] = {
+    &fullShuffle,
+    &noLanes,
+    &noCycles,
+    &avgConcentrate,
+};
+
+// Switches to flip (-compare).
+static bool compareFlip[NUM_SWITCHES];
+
+// Each kind of random decision uses its own random number stream, so that
+// a change to the deck which adds or removes some decisions doesn't change
+// the random numbers used by all the other ones.  The first streams are the
+// roll types (see Chance()).
+enum rngStreams {
+    STREAM_SHUFFLE = NUM_ROLL_TYPES,	// Deck order.
+    STREAM_DEMON,			// Demon picking target cards.
+    STREAM_PLAYER,			// Player abilities picking cards.
+    NUM_STREAMS
+};
+
+// When a round is replayed by the -fork engine, this holds the outcome to
+// use for each random decision of the round, in the order they are made.
+// See ForkDraw().
+typedef struct forkPath {
+    int		numDraws;		// Decisions made so far in this replay.
+    int		numScripted;		// Decisions with a preset outcome.
+    bool	overflow;		// More than MAX_FORK_DRAWS decisions.
+    int		choice[MAX_FORK_DRAWS];	// Outcome of each decision.
+    int		range[MAX_FORK_DRAWS];	// Number of possible outcomes.
+    double	prob[MAX_FORK_DRAWS];	// Probability of the outcome.
+} ForkPath;
+
 // The State structure holds the entire state of a simulation.
 typedef struct state {
     int			dmgDone;		// Damage done to demon.
@@ -303,8 +463,14 @@ typedef struct state {
     CardSet		field;			// Cards on field.
     CardSet		grave;			// Cards in grave.
     Rune		runes[MAX_RUNES];	// Array of runes.
-    unsigned int	seedW;			// Random seed part 1.
-    unsigned int	seedZ;			// Random seed part 2.
+    unsigned int	seedW[NUM_STREAMS];	// Random seeds part 1.
+    unsigned int	seedZ[NUM_STREAMS];	// Random seeds part 2.
+    bool		antithetic;		// Complement random numbers.
+    int			numRolls;		// Random decisions made.
+    int			rollExcess[NUM_ROLL_TYPES];// See Chance().
+    ForkPath	       *fork;			// If not NULL, scripted draws.
+    int			numUnseen;		// Deck cards not yet in order.
+    double		weight;			// Likelihood ratio (-tilt).
 } State;
 
 typedef struct result {
@@ -315,14 +481,67 @@ typedef struct result {
     int       lowDamage;
     int       highDamage;
     int       timesRoundX;
+    int       randomFights;	// Fights with random events (not shuffle).
+    // Only used by -fork, where each fight is a weighted tree of outcomes.
+    double    expDmg;		// Sum of the expected dmg of each fight.
+    double    expDmgSq;		// Sum of the squares of the above.
+    double    expRounds;	// Sum of the expected rounds of each fight.
+    double    expRoundX;	// Sum of the chance of reaching round X.
+    long long forkRounds;	// Number of rounds simulated.
+    long long forkLeaves;	// Number of fight outcomes explored.
+    int       sampledFights;	// Fights where part of the tree was sampled.
+    // Only used by -tilt, where each fight has a likelihood ratio weight.
+    double    sumWeight;	// Sum of the weights.
+    double    sumWeightSq;	// Sum of the squares of the weights.
+    double    wDmg;		// Sum of weight * dmg.
+    double    wDmgSq;		// Sum of (weight * dmg)^2.
+    double    wRounds;		// Sum of weight * rounds.
+    double    wRoundX;		// Sum of weights of fights reaching round X.
+    double    wRoundXSq;	// Sum of the squares of the above weights.
+    double    wTail;		// Sum of weights of fights above -taildmg.
+    double    wTailSq;		// Sum of the squares of the above weights.
 } Result;
 
 typedef struct task {
-    State   *state;
-    int      numIterations;
-    Result  *result;
+    State       *state;
+    const State *initial;		// State each fight starts from.
+    int          firstFight;		// Fight number of first fight.
+    int          numIterations;
+    Result      *result;
+    int         *fightDmg;		// If not NULL, gets dmg of each fight.
+    int         *fightRounds;		// If not NULL, gets rounds of each.
+    const unsigned char *orders;	// If not NULL, deck order of each.
+    int          numShuffled;		// With orders, # of cards to shuffle.
+    bool         antithetic;		// Run fights in antithetic pairs.
+    int         *fightControls;		// If not NULL, gets rollExcess of each.
+    bool         fork;			// Explore each fight with ForkFight.
 } Task;
 
+// One of the demon's abilities on its turn, with the ability's level.
+typedef void (*DemonAbility)(State *state, int level);
+
+typedef struct demonStep {
+    DemonAbility	func;
+    int			level;
+} DemonStep;
+
+// The demon's abilities don't change during a run, so what the demon does
+// is worked out once at startup (see InitDemonProfile), instead of looking
+// through its abilities each time.
+typedef struct demonProfile {
+    int			numSteps;
+    DemonStep		steps[MAX_ATTR];	// Turn abilities, in order.
+    bool		hotChase;
+    int			hotChaseLevel;
+    int			numCountered;		// 2 for retaliation, 1 for
+    int			counterLevel;		// counterattack.
+    bool		wickedLeech;
+    int			wickedLeechLevel;
+    bool		chainAttack;
+    int			chainAttackLevel;
+    bool		lacerate;
+} DemonProfile;
+
 #define DIM(a)		(sizeof(a)/sizeof(a[0]))
 #define MIN(x,y)	((x) < (y) ? (x) : (y))
 #define MAX(x,y)	((x) > (y) ? (x) : (y))
@@ -336,10 +555,14 @@ static void SimReincarnate(State *state, const char *attrName, int level);
 static void SimReanimate(State *state, const char *attrName);
 static int PickAliveCardFromSet(State *state, const CardSet *cs);
 static void AddCardToSetRandomly(State *state, CardSet *cs, const Card *c);
+static unsigned int ForkDraw(State *state, int range, int percent);
 
 static Card cardTypes[MAX_CARD_TYPES];
 static int numCardTypes;
 
+// The demon of this run (see InitDemonProfile).
+static DemonProfile demonProfile;
+
 typedef struct AttrLookup {
     const char *name;
     int         attrType;
@@ -430,11 +653,13 @@ static const Rune allRunes[] = {
 
 static const Card DeadCard = {
     /* name        = */ "Dead Card",
+    /* id          = */ -1,
     /* cost        = */ 0,
     /* timing      = */ 0,
     /* baseAtk     = */ 0,
     /* baseHp      = */ 0,
     /* baseAttr[0] = */ {{ ATTR_DEAD, 0 }, {ATTR_NONE, 0}},
+    /* numBaseAttr = */ 1,
     /* curTiming   = */ 0,
     /* atk         = */ 0,
     /* curBaseAtk  = */ 0,
@@ -511,6 +736,188 @@ static void AllocateStates(int numStates)
     }
 }
 
+// The kinds of names in the name index.
+enum {
+    NAME_ATTR = 1,
+    NAME_CARD = 2,
+    NAME_RUNE = 4,
+};
+
+// One entry of the name index.  The index is an open addressed hash table
+// of every attribute, card and rune name, so that looking a name up while
+// parsing doesn't have to compare it against every name in the tables.
+typedef struct NameEntry {
+    const char	*name;			// NULL if the slot is empty.
+    int		 kind;
+    int		 index;			// Into allAttrs, cardTypes or allRunes.
+} NameEntry;
+
+static NameEntry nameIndex[NAME_INDEX_SIZE];
+
+typedef char nameIndexCheck[NAME_INDEX_SIZE >=
+	2 * (MAX_CARD_TYPES + DIM(allAttrs) + DIM(allRunes)) ? 1 : -1];
+
+/**
+ * Returns a case insensitive hash of a name.
+ *
+ * @param	name		The name.
+ * @return			The hash.
+ */
+static unsigned int NameHash(const char *name)
+{
+    unsigned int hash = 2166136261u;
+
+    for (;*name;name++) {
+	hash ^= (unsigned char) tolower((unsigned char) *name);
+	hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Finds the slot of a name in the name index.
+ *
+ * @param	kind		The kind of name.
+ * @param	name		The name.
+ * @return			The slot holding the name, or the empty slot
+ *				where it would go.
+ */
+static NameEntry *NameSlot(int kind, const char *name)
+{
+    unsigned int i = NameHash(name) & (NAME_INDEX_SIZE - 1);
+
+    while (nameIndex[i].name != NULL) {
+	if (nameIndex[i].kind == kind && !strcasecmp(name, nameIndex[i].name))
+	    break;
+	i = (i + 1) & (NAME_INDEX_SIZE - 1);
+    }
+    return &nameIndex[i];
+}
+
+/**
+ * Adds a name to the name index.  If the name is already there, the first
+ * one is kept, which is the one a linear search would have found.
+ *
+ * @param	kind		The kind of name.
+ * @param	name		The name.
+ * @param	index		The index of the name in its table.
+ */
+static void AddName(int kind, const char *name, int index)
+{
+    NameEntry *e = NameSlot(kind, name);
+
+    if (e->name == NULL) {
+	e->name  = name;
+	e->kind  = kind;
+	e->index = index;
+    }
+}
+
+/**
+ * Empties the name index and puts the attribute and rune names in it.  This
+ * is done before reading the card types, which are added as they are read.
+ */
+static void ResetNameIndex(void)
+{
+    int i = 0;
+
+    memset(nameIndex, 0, sizeof(nameIndex));
+    for (i=0;i<DIM(allAttrs);i++)
+	AddName(NAME_ATTR, allAttrs[i].name, i);
+    for (i=0;i<DIM(allRunes);i++)
+	AddName(NAME_RUNE, allRunes[i].name, i);
+}
+
+/**
+ * Returns how many single character edits (case insensitive) it takes to
+ * turn one name into another, up to a limit.
+ *
+ * @param	a		The first name.
+ * @param	b		The second name.
+ * @param	limit		Distances over this are returned as limit+1.
+ * @return			The edit distance.
+ */
+static int NameDistance(const char *a, const char *b, int limit)
+{
+    int lenA = strlen(a);
+    int lenB = strlen(b);
+    int row[MAX_LINE_SIZE+1];
+    int i    = 0;
+    int j    = 0;
+
+    if (abs(lenA - lenB) > limit)
+	return limit + 1;
+    for (j=0;j<=lenB;j++)
+	row[j] = j;
+    for (i=1;i<=lenA;i++) {
+	int diag = row[0];
+	int best = i;
+
+	row[0] = i;
+	for (j=1;j<=lenB;j++) {
+	    int up = row[j];
+	    int d  = diag + (tolower((unsigned char) a[i-1]) !=
+			     tolower((unsigned char) b[j-1]));
+
+	    d      = MIN(d, up + 1);
+	    d      = MIN(d, row[j-1] + 1);
+	    row[j] = d;
+	    diag   = up;
+	    best   = MIN(best, d);
+	}
+	if (best > limit)
+	    return limit + 1;
+    }
+    return row[lenB];
+}
+
+/**
+ * Finds the known name closest to a name that wasn't found, for error
+ * messages.  This goes through the whole index, which is fine because it
+ * is only done once, just before exiting.
+ *
+ * @param	kinds		The kinds of names to consider (NAME_ATTR,
+ *				NAME_CARD and/or NAME_RUNE).
+ * @param	name		The name that wasn't found.
+ * @return			The closest name, or NULL if none is close.
+ */
+static const char *SuggestName(int kinds, const char *name)
+{
+    const char *best     = NULL;
+    int         bestDist = MAX(2, (int) strlen(name) / 3);
+    int         i        = 0;
+
+    for (i=0;i<NAME_INDEX_SIZE;i++) {
+	const NameEntry *e = &nameIndex[i];
+	int              d = 0;
+
+	if (e->name == NULL || !(e->kind & kinds))
+	    continue;
+	d = NameDistance(name, e->name, bestDist);
+	if (d <= bestDist && (best == NULL || d < bestDist ||
+		    strcasecmp(e->name, best) < 0)) {
+	    best     = e->name;
+	    bestDist = d;
+	}
+    }
+    return best;
+}
+
+/**
+ * Prints a "did you mean" line for a name that wasn't found, if some known
+ * name is close to it.
+ *
+ * @param	kinds		The kinds of names to consider.
+ * @param	name		The name that wasn't found.
+ */
+static void PrintSuggestion(int kinds, const char *name)
+{
+    const char *suggestion = SuggestName(kinds, name);
+
+    if (suggestion != NULL)
+	fprintf(stderr, "Did you mean %s?\n", suggestion);
+}
+
 /**
  * Finds an attribute by name from the global array of attributes (allAttrs).
  *
@@ -520,13 +927,9 @@ static void AllocateStates(int numStates)
  */
 static int LookupAttr(const char *name)
 {
-    int i = 0;
+    const NameEntry *e = NameSlot(NAME_ATTR, name);
 
-    for (i=0;i<DIM(allAttrs);i++) {
-	if (!strcasecmp(name, allAttrs[i].name))
-	    return allAttrs[i].attrType;
-    }
-    return -1;
+    return (e->name != NULL) ? allAttrs[e->index].attrType : -1;
 }
 
 /**
@@ -538,13 +941,9 @@ static int LookupAttr(const char *name)
  */
 static const Card *FindCard(const char *name)
 {
-    int i = 0;
+    const NameEntry *e = NameSlot(NAME_CARD, name);
 
-    for (i=0;i<numCardTypes;i++) {
-	if (!strcasecmp(name, cardTypes[i].name))
-	    return &cardTypes[i];
-    }
-    return NULL;
+    return (e->name != NULL) ? &cardTypes[e->index] : NULL;
 }
 
 /**
@@ -556,13 +955,9 @@ static const Card *FindCard(const char *name)
  */
 static const Rune *FindRune(const char *name)
 {
-    int i = 0;
+    const NameEntry *e = NameSlot(NAME_RUNE, name);
 
-    for (i=0;i<DIM(allRunes);i++) {
-	if (!strcasecmp(name, allRunes[i].name))
-	    return &allRunes[i];
-    }
-    return NULL;
+    return (e->name != NULL) ? &allRunes[e->index] : NULL;
 }
 
 /**
@@ -575,43 +970,39 @@ static const Rune *FindRune(const char *name)
  */
 static void InitCard(Card *card)
 {
-    int i = 0;
-    int j = 0;
-
     card->curTiming  = card->timing;
     card->atk        = card->baseAtk;
     card->curBaseAtk = card->baseAtk;
     card->hp         = card->baseHp;
     card->maxHp      = card->baseHp;
-    card->numAttr    = card->baseHp;
 
-    memset(card->attr, 0, sizeof(card->attr));
-    card->numAttr = 0;
-    for (i=0, j=0;i<MAX_ATTR;i++) {
-	if (card->baseAttr[i].type != ATTR_NONE) {
-	    card->attr[j++] = card->baseAttr[i];
-	    card->numAttr++;
-	}
-    }
+    // The base attributes are stored without gaps (see
+    // readCardTypesFromFile), so only the used ones need to be copied.
+    card->numAttr = card->numBaseAttr;
+    memcpy(card->attr, card->baseAttr, card->numBaseAttr * sizeof(Attr));
 }
 
 /**
  * Returns a random number.  This function is based on the MWC generator,
  * which concatenates two 16-bit multiply with carry generators.  It uses
- * two seeds stored in the state (seedW and seedZ).  The reason why I use
- * this rng is because it is reentrant (it can be run simultaneously by
- * multiple cores).
+ * two seeds stored in the state (seedW and seedZ) for each stream.  The
+ * reason why I use this rng is because it is reentrant (it can be run
+ * simultaneously by multiple cores).
  *
  * @param	state		The simulator state.  Both seedW and seedZ
- *				are updated to new values on each call.
+ *				of the stream are updated on each call.
+ * @param	stream		The random number stream (e.g. STREAM_SHUFFLE).
  * @return			A 32-bit random number.
  */
-static unsigned int myRand(State *state)
+static unsigned int myRand(State *state, int stream)
 {
-    state->seedW = 18000*(state->seedW & 65535) + (state->seedW >> 16);
-    state->seedZ = 36969*(state->seedZ & 65535) + (state->seedZ >> 16);
+    unsigned int *w = &state->seedW[stream];
+    unsigned int *z = &state->seedZ[stream];
+
+    *w = 18000*(*w & 65535) + (*w >> 16);
+    *z = 36969*(*z & 65535) + (*z >> 16);
 
-    return (state->seedZ << 16) + state->seedW;
+    return (*z << 16) + *w;
 }
 
 /**
@@ -619,35 +1010,202 @@ static unsigned int myRand(State *state)
  * function to get the random number.
  * 
  * @param	state		The simulator state.
+ * @param	stream		The random number stream (e.g. STREAM_SHUFFLE).
  * @param	range		Range of random number.
  * @return			A random number in the range [0..range-1].
  */
-static unsigned int Rnd(State *state, unsigned int range)
+static unsigned int Rnd(State *state, int stream, unsigned int range)
 {
-    return (((unsigned int) myRand(state)) % range);
+    unsigned int r = 0;
+
+    if (state->fork != NULL) {
+	if (range <= 1)
+	    return 0;
+	state->numRolls++;
+	return ForkDraw(state, range, -1);
+    }
+    r = ((unsigned int) myRand(state, stream)) % range;
+    if (range > 1)
+	state->numRolls++;
+    // The second fight of an antithetic pair gets the opposite numbers, on
+    // every stream, so its deck order is different too.
+    if (state->antithetic)
+	r = range - 1 - r;
+    return r;
 }
 
 /**
- * Given a card set, shuffle the cards into a random order.
+ * Makes a random yes/no decision that succeeds percent% of the time.  It
+ * also keeps track of how many more successes there were than expected for
+ * each kind of decision, in units of 1/100 of a success.  Each roll adds
+ * (100 - percent) on success and -percent on failure, so the expected total
+ * is exactly 0.  This makes the totals good control variates (see
+ * RunVarianceReduction).
+ *
+ * With -tilt, the chance of success is shifted for some kinds of decisions,
+ * and the fight's weight is multiplied by how much more or less likely the
+ * outcome was without the shift (the likelihood ratio).  Weighted averages
+ * over the fights are then the same as without the shift on average.
  *
  * @param	state		The simulator state.
- * @param	cs		The card set to shuffle.
+ * @param	rollType	The kind of decision (e.g. ROLL_DODGE).
+ * @param	percent		The chance of success, from 0 to 100.
+ * @return			True on success.
  */
-static void ShuffleSet(State *state, CardSet *cs)
+static bool Chance(State *state, int rollType, int percent)
+{
+    bool hit    = false;
+    int  tilted = percent;
+
+    if (tiltPercent[rollType] != 0 && percent > 0 && percent < 100)
+	tilted = MIN(MAX(percent + tiltPercent[rollType], 1), 99);
+
+    if (state->fork == NULL) {
+	hit = ((int) Rnd(state, rollType, 100) < tilted);
+	if (tilted != percent) {
+	    if (hit)
+		state->weight *= (double) percent / tilted;
+	    else
+		state->weight *= (double) (100 - percent) / (100 - tilted);
+	}
+    } else if (percent >= 100)
+	hit = true;
+    else if (percent > 0)
+	hit = (ForkDraw(state, 2, percent) == 0);
+
+    state->rollExcess[rollType] += (hit ? 100 : 0) - percent;
+    return hit;
+}
+
+/**
+ * Makes a random decision while the -fork engine replays a round.  Instead
+ * of using the rng, the outcome comes from the state's ForkPath.  Decisions
+ * past the scripted ones take their first outcome, and their number of
+ * outcomes is recorded so that the engine can go through the other ones on
+ * later replays.
+ *
+ * @param	state		The simulator state.
+ * @param	range		The number of possible outcomes.
+ * @param	percent		For a yes/no decision, the chance of outcome 0
+ *				(yes).  For -1, all outcomes are equally likely.
+ * @return			The outcome, from 0 to range-1.
+ */
+static unsigned int ForkDraw(State *state, int range, int percent)
+{
+    ForkPath *path = state->fork;
+    int       k    = path->numDraws;
+    int       c    = 0;
+
+    if (k >= MAX_FORK_DRAWS) {
+	path->overflow = true;
+	return 0;
+    }
+    if (k < path->numScripted)
+	c = path->choice[k];
+    path->choice[k] = c;
+    path->range[k]  = range;
+    if (percent < 0)
+	path->prob[k] = 1.0 / range;
+    else
+	path->prob[k] = (c == 0 ? percent : 100 - percent) / 100.0;
+    path->numDraws++;
+    return c;
+}
+
+/**
+ * Scrambles the bits of a 32-bit number.  This is used to turn the run seed
+ * and fight number into well distributed rng seeds.
+ *
+ * @param	x		The number to scramble.
+ * @return			The scrambled number.
+ */
+static unsigned int MixBits(unsigned int x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+/**
+ * Seeds the rng for one fight.  The seeds only depend on the run seed and
+ * the fight number, so fight N sees the same random numbers no matter which
+ * thread runs it.  This is what lets two runs with different decks be
+ * compared fight by fight (common random numbers).  Each stream gets its
+ * own seeds.
+ *
+ * @param	state		The simulator state.
+ * @param	fightNum	The fight number within the run.
+ */
+static void SeedFight(State *state, int fightNum)
+{
+    unsigned int base = (unsigned int) fightNum * NUM_STREAMS;
+    int          i    = 0;
+
+    for (i=0;i<NUM_STREAMS;i++) {
+	state->seedW[i] = MixBits(runSeed ^ MixBits(2 * (base + i) + 1));
+	state->seedZ[i] = MixBits(runSeed ^ MixBits(2 * (base + i) + 2));
+
+	// The MWC generator gets stuck on a zero seed.
+	if (state->seedW[i] == 0)
+	    state->seedW[i] = 1;
+	if (state->seedZ[i] == 0)
+	    state->seedZ[i] = 1;
+    }
+}
+
+/**
+ * Shuffles an array of cards into a random order.
+ *
+ * @param	state		The simulator state.
+ * @param	cards		The cards to shuffle.
+ * @param	numCards	The number of cards.
+ */
+static void ShuffleCards(State *state, Card *cards, int numCards)
 {
     int i = 0;
 
-    for (i=0;i<cs->numCards-1;i++) {
-	unsigned int r = Rnd(state, cs->numCards - i);
+    for (i=0;i<numCards-1;i++) {
+	unsigned int r = Rnd(state, STREAM_SHUFFLE, numCards - i);
 
 	if (r != 0) {
-	    Card tmp = cs->cards[i];
-	    cs->cards[i]   = cs->cards[i+r];
-	    cs->cards[i+r] = tmp;
+	    Card tmp   = cards[i];
+	    cards[i]   = cards[i+r];
+	    cards[i+r] = tmp;
 	}
     }
 }
 
+/**
+ * Given a card set, shuffle the cards into a random order.
+ *
+ * @param	state		The simulator state.
+ * @param	cs		The card set to shuffle.
+ */
+static void ShuffleSet(State *state, CardSet *cs)
+{
+    ShuffleCards(state, cs->cards, cs->numCards);
+}
+
+/**
+ * Sets the deck to a given order instead of shuffling it.
+ *
+ * @param	state		The simulator state.
+ * @param	initial		The initial state the fight started from.
+ * @param	order		For each deck slot, the index of the card in
+ *				the initial deck to put there.
+ */
+static void SetDeckOrder(State *state, const State *initial,
+	const unsigned char *order)
+{
+    int i = 0;
+
+    for (i=0;i<state->deck.numCards;i++)
+	state->deck.cards[i] = initial->deck.cards[order[i]];
+}
+
 /**
  * Prints the card state (debug mode only).  The type of printout depends
  * on which set we are printing.
@@ -732,6 +1290,11 @@ static bool HasAttr(const Card *c, int attrType, int *pLevel)
 {
     int i = 0;
 
+#if defined(SIM_COMPILED)
+    if (!compiledAttrs[attrType])
+	return false;
+#endif
+
     for (i=0;i<c->numAttr;i++) {
 	if (c->attr[i].type == attrType) {
 	    if (pLevel != NULL)
@@ -839,7 +1402,7 @@ static void AddCardToSet(CardSet *cs, const Card *c)
  */
 static void AddCardToSetRandomly(State *state, CardSet *cs, const Card *c)
 {
-    int r = Rnd(state, cs->numCards+1);
+    int r = Rnd(state, STREAM_SHUFFLE, cs->numCards+1);
     int i = 0;
 
     if (cs->numCards >= MAX_CARDS_IN_SET) {
@@ -854,6 +1417,11 @@ static void AddCardToSetRandomly(State *state, CardSet *cs, const Card *c)
 
     // Insert card at r.
     cs->cards[r] = *c;
+
+    // A card inserted among the deck cards that aren't in order yet becomes
+    // one of them.
+    if (cs == &state->deck && r <= state->numUnseen)
+	state->numUnseen++;
     cs->numCards++;
 }
 
@@ -880,6 +1448,7 @@ static void InitDefaultState(State *state)
     c = FindCard(theDemon);
     if (c == NULL) {
 	fprintf(stderr, "Couldn't find demon card: %s\n", theDemon);
+	PrintSuggestion(NAME_CARD, theDemon);
 	exit(1);
     }
     memcpy(&state->demon, c, sizeof(Card));
@@ -908,19 +1477,18 @@ static void InitDefaultState(State *state)
 
 /**
  * Initializes a state in order to start a new simulation run.  This merely
- * copies the default state, but preserves the current rng seeds so that
- * we have new random numbers on each run.
+ * copies the initial state (normally the default state) and then seeds the
+ * rng for the given fight.
  *
  * @param	state		The simulator state to initialize.
+ * @param	initial		The state to start from.
+ * @param	fightNum	The fight number (used to seed the rng).
  */
-static void InitState(State *state)
+static void InitState(State *state, const State *initial, int fightNum)
 {
-    unsigned int seedSaveW = state->seedW;
-    unsigned int seedSaveZ = state->seedZ;
-
-    memcpy(state, &defaultState, sizeof(State));
-    state->seedW = seedSaveW;
-    state->seedZ = seedSaveZ;
+    memcpy(state, initial, sizeof(State));
+    SeedFight(state, fightNum);
+    state->weight = 1.0;
 }
 
 /**
@@ -1156,8 +1724,7 @@ static void RemoveCard(State *state, Card *c, int sendToGraveyard)
 	CardSet *destination = &state->grave;
 	dprintf("%s died.\n", c->name);
 	if (HasAttr(c, ATTR_DIRT, &level)) {
-	    int r = Rnd(state, 100);
-	    if (r < level) {
+	    if (Chance(state, ROLL_RESURRECT, level)) {
 		if (state->hand.numCards >= MAX_CARDS_IN_HAND) {
 		    dprintf("%s resurrected (Dirt) to deck because "
 			    "hand is full.\n", c->name); 
@@ -1169,8 +1736,7 @@ static void RemoveCard(State *state, Card *c, int sendToGraveyard)
 	    }
 	}
 	if (HasAttr(c, ATTR_RESURRECTION, &level)) {
-	    int r = Rnd(state, 100);
-	    if (r < level) {
+	    if (Chance(state, ROLL_RESURRECT, level)) {
 		if (state->hand.numCards >= MAX_CARDS_IN_HAND) {
 		    dprintf("%s resurrected to deck because hand is full.\n",
 			    c->name); 
@@ -1233,7 +1799,7 @@ static int PickNCards(State *state, CardSet *cs, int n, int *ret)
 
     // Now randomly pick n cards out of numAlive cards.
     for (i=0;i<n;i++) {
-	unsigned int r = Rnd(state, numAlive - 1 - i);
+	unsigned int r = Rnd(state, STREAM_DEMON, numAlive - 1 - i);
 
 	if (r != 0) {
 	    int tmp  = ret[i];
@@ -1281,14 +1847,14 @@ static void SimDemonTrap(State *state, int numToTrap)
     if (numTrapped == 0)
 	return;
     for (i=0;i<numTrapped;i++) {
-	int r = Rnd(state, 100);
-	Card *c = &f->cards[trapped[i]];
+	bool  hit = Chance(state, ROLL_TRAP, 65);
+	Card *c   = &f->cards[trapped[i]];
 
 	if (HasAttr(c, ATTR_IMMUNITY, NULL)) {
 	    dprintf("%s not trapped because of immunity.\n", c->name);
 	} else if (HasAttr(c, ATTR_EVASION, NULL)) {
 	    dprintf("%s not trapped because of evasion.\n", c->name);
-	} else if (r < 65) {
+	} else if (hit) {
 	    Attr trapAttr = { ATTR_TRAP_BUFF, 0 };
 	    AddAttr(c, &trapAttr);
 	    dprintf("%s trapped.\n", c->name);
@@ -1408,17 +1974,13 @@ static int DamageCard(State *state, Card *c, int dmg)
 
     // Apply damage avoidance and mitigation.
     if (HasAttr(c, ATTR_NIMBLE_SOUL, &level)) {
-	int r = Rnd(state, 100);
-
-	if (r < level) {
+	if (Chance(state, ROLL_DODGE, level)) {
 	    dprintf("%s dodged (nimble soul).\n", c->name);
 	    return 0;
 	}
     }
     if (HasAttr(c, ATTR_DODGE, &level)) {
-	int r = Rnd(state, 100);
-
-	if (r < level) {
+	if (Chance(state, ROLL_DODGE, level)) {
 	    dprintf("%s dodged.\n", c->name);
 	    return 0;
 	}
@@ -1488,7 +2050,7 @@ static int DamageCard(State *state, Card *c, int dmg)
     if (c->hp == 0)
 	RemoveCard(state, c, 1);
     // Lacerate the card, if the demon has lacerate.
-    if (c->hp > 0 && HasAttr(&state->demon, ATTR_LACERATE, NULL))
+    if (c->hp > 0 && demonProfile.lacerate)
 	SimDemonLacerate(c);
     return dmg;
 }
@@ -1507,8 +2069,7 @@ static void SimDemonAttack(State *state, int dmg)
     dprintf("Attack: %d dmg.  ", dmg);
     if (f->numCards > 0) {
 	Card       *c        = &f->cards[0];
-	int         level    = 0;
-	const char *cardName = c->name;
+	int         cardId   = c->id;
 
 	// If the leftmost card is not dead, hit the leftmost card.
 	if (!HasAttr(c, ATTR_DEAD, NULL)) {
@@ -1517,18 +2078,19 @@ static void SimDemonAttack(State *state, int dmg)
 
 	    // If the demon has Chain Attack, it does extra damage to each card
 	    // of the same name.
-	    if (newDmg > 0 && HasAttr(&state->demon, ATTR_CHAIN_ATTACK, &level)){
+	    if (newDmg > 0 && demonProfile.chainAttack) {
 		int i = 0;
 
 		// The chain attack damage is normally greater than the
 		// initial hit.
-		newDmg = (newDmg * level) / 100;
+		newDmg = (newDmg * demonProfile.chainAttackLevel) / 100;
 
-		// Look for cards with the same name.
+		// Look for cards of the same type.  The id of the first card
+		// is kept from before the hit, since it may have died.
 		for (i=1;i<f->numCards;i++) {
 		    Card *c2 = &f->cards[i];
 		    if (!HasAttr(c2, ATTR_DEAD, NULL) && c2->hp > 0 &&
-			    !strcmp(cardName, c2->name)) {
+			    c2->id == cardId) {
 			// Found a card with the same name.  Apply newDmg.
 			dprintf("Chain attack on %s for %d damage.\n",
 				c2->name, newDmg);
@@ -1545,183 +2107,291 @@ static void SimDemonAttack(State *state, int dmg)
 }
 
 /**
- * Simulates the demon's round.
+ * Returns the unavoidable damage the player takes in the given round.
  *
- * @param	state		The simulator state.
+ * @param	round		The round (a demon round).
+ * @return			The unavoidable damage.
  */
-static void SimDemon(State *state)
+static int UnavoidableDamage(int round)
 {
-    int      i = 0;
-    Card    *d = &state->demon;
-    CardSet *f = &state->field;
-
-    if (state->round < FIRST_DEMON_ROUND)
-	return;
-    else if (state->round == FIRST_DEMON_ROUND)
-	dprintf("%s appears.\n", d->name);
+    if (round < FIRST_UNAVOIDABLE_ROUND)
+	return 0;
+    return ((round - FIRST_UNAVOIDABLE_ROUND) / 2) * 60 + 80;
+}
 
-    vprintf("%s's turn:\n", d->name);
+/**
+ * Simulates the demon Curse ability.
+ *
+ * @param	state		The simulator state.
+ * @param	level		Damage to the player.
+ */
+static void SimDemonCurse(State *state, int level)
+{
+    dprintf("Curse : %d dmg.  ", level);
+    DamagePlayer(state, level);
+}
 
-    // At round 51, the player starts taking unavoidable damage.
-    if (state->round >= 51) {
-	int dmg = ((state->round - 51) / 2) * 60 + 80;
+/**
+ * Simulates the demon Damnation ability.
+ *
+ * @param	state		The simulator state.
+ * @param	level		Damage to the player per card on the field.
+ */
+static void SimDemonDamnation(State *state, int level)
+{
+    int dmg = level * state->field.numCards;
 
-	dmg = MIN(dmg, state->hp);
-	state->hp -= dmg;
-	dprintf("Player takes %d unavoidable damage (%d left)\n",
-		dmg, state->hp);
+    if (dmg > 0) {
+	dprintf("Damnation: %d dmg.  ", dmg);
+	DamagePlayer(state, dmg);
     }
+}
 
-    // Handle demon abilities.
-    for (i=0;i<d->numAttr;i++) {
-	if (state->hp <= 0)
-	    break;
-	switch (d->attr[i].type) {
-	    case ATTR_CURSE:
-	    {
-		int dmg = d->attr[i].level;
-		dprintf("Curse : %d dmg.  ", dmg);
-		DamagePlayer(state, dmg);
-		break;
-	    }
-	    case ATTR_DAMNATION:
-	    {
-		int dmg = d->attr[i].level * state->field.numCards;
+/**
+ * Simulates the demon Exile ability.
+ *
+ * @param	state		The simulator state.
+ * @param	level		Unused.
+ */
+static void SimDemonExile(State *state, int level)
+{
+    CardSet *f = &state->field;
 
-		if (dmg > 0) {
-		    dprintf("Damnation: %d dmg.  ", dmg);
-		    DamagePlayer(state, dmg);
-		}
-		break;
-	    }
-	    case ATTR_EXILE:
-		if (f->numCards > 0) {
-		    Card *c = &f->cards[0];
-
-		    if (c->hp > 0) {
-			dprintf("Exile cast on %s.\n", c->name);
-			if (!HasAttr(c, ATTR_RESISTANCE, NULL) &&
-				!HasAttr(c, ATTR_IMMUNITY, NULL)) {
-			    RemoveCard(state, c, 0);
-			}
-		    } else {
-			dprintf("%s resisted Exile.\n", c->name);
-		    }
-		}
-		break;
-	    case ATTR_SNIPE:
-	    {
-		Card *c   = FindLowestHpCard(state, f, false);
-		int   dmg = d->attr[i].level;
+    if (f->numCards > 0) {
+	Card *c = &f->cards[0];
 
-		if (c == NULL)
-		    break;
-		dmg = MIN(dmg, c->hp);
-		dprintf("Devil's blade: %d dmg to %s.\n", dmg, c->name);
-		c->hp -= dmg;
-		if (c->hp == 0)
-		    RemoveCard(state, c, 1);
-		break;
+	if (c->hp > 0) {
+	    dprintf("Exile cast on %s.\n", c->name);
+	    if (!HasAttr(c, ATTR_RESISTANCE, NULL) &&
+		    !HasAttr(c, ATTR_IMMUNITY, NULL)) {
+		RemoveCard(state, c, 0);
 	    }
-	    case ATTR_MANA_CORRUPT:
-	    {
-		int   r   = 0;
-		Card *c   = NULL;
-		int   dmg = d->attr[i].level;
+	} else {
+	    dprintf("%s resisted Exile.\n", c->name);
+	}
+    }
+}
 
-		r = PickAliveCardFromSet(state, f);
-		if (r == -1)
-		    break;
+/**
+ * Simulates the demon Snipe (Devil's blade) ability.
+ *
+ * @param	state		The simulator state.
+ * @param	level		Damage to the card with the lowest hp.
+ */
+static void SimDemonSnipe(State *state, int level)
+{
+    Card *c   = FindLowestHpCard(state, &state->field, false);
+    int   dmg = level;
 
-		c = &f->cards[r];
-		if (HasAttr(c, ATTR_REFLECTION, NULL) ||
-			HasAttr(c, ATTR_IMMUNITY, NULL))
-		    dmg *= 3;
-		dmg = MIN(dmg, c->hp);
-		dprintf("Mana corrupt: %d dmg to %s.\n", dmg, c->name);
-		c->hp -= dmg;
-		if (c->hp == 0)
-		    RemoveCard(state, c, 1);
-		break;
-	    }
-	    case ATTR_DESTROY:
-	    {
-		int   r = 0;
-		Card *c = NULL;
+    if (c == NULL)
+	return;
+    dmg = MIN(dmg, c->hp);
+    dprintf("Devil's blade: %d dmg to %s.\n", dmg, c->name);
+    c->hp -= dmg;
+    if (c->hp == 0)
+	RemoveCard(state, c, 1);
+}
 
-		r = PickAliveCardFromSet(state, f);
-		if (r == -1)
-		    break;
+/**
+ * Simulates the demon Mana corrupt ability.
+ *
+ * @param	state		The simulator state.
+ * @param	level		Damage to a random card.
+ */
+static void SimDemonManaCorrupt(State *state, int level)
+{
+    CardSet *f   = &state->field;
+    int      r   = 0;
+    Card    *c   = NULL;
+    int      dmg = level;
 
-		c = &f->cards[r];
-		dprintf("Destroy cast on %s.\n", c->name);
-		if (!HasAttr(c, ATTR_RESISTANCE, NULL) &&
-			!HasAttr(c, ATTR_IMMUNITY, NULL)) {
-		    c->hp = 0;
-		    RemoveCard(state, c, 1);
-		} else {
-		    dprintf("%s resisted Destroy.\n", c->name);
-		}
-		break;
-	    }
-	    case ATTR_FIRE_GOD:
-	    {
-		int j;
-		for (j=0;j<f->numCards;j++) {
-		    Card *c = &f->cards[j];
-		    if (c->hp <= 0)
-			continue;
-		    if (HasAttr(c, ATTR_IMMUNITY, NULL)) {
-			dprintf("%s immune to Fire God.\n", c->name);
-		    } else if (!HasAttr(c, ATTR_FIRE_GOD, NULL)) {
-			dprintf("Fire God cast on %s.\n", c->name);
-			AddAttr(c, &d->attr[i]);
-		    }
-		}
-		break;
-	    }
-	    case ATTR_TOXIC_CLOUDS:
-	    {
-		int j;
-		for (j=0;j<f->numCards;j++) {
-		    int dmg = d->attr[i].level;
-		    Card *c = &f->cards[j];
+    r = PickAliveCardFromSet(state, f);
+    if (r == -1)
+	return;
 
-		    if (c->hp <= 0)
-			continue;
-		    if (HasAttr(c, ATTR_IMMUNITY, NULL)) {
-			dprintf("%s immune to Toxic Clouds.\n", c->name);
-			break;
-		    }
-		    dmg = MIN(dmg, c->hp);
-		    c->hp -= dmg;
-		    dprintf("Toxic clouds does %d dmg to %s "
-			    "(%d hp left).\n", dmg, c->name, c->hp);
-		    if (c->hp <= 0)
-			RemoveCard(state, c, 1);
-		    else if (!HasAttr(c, ATTR_TOXIC_CLOUDS, NULL))
-			AddAttr(c, &d->attr[i]);
-		}
-		break;
-	    }
-	    case ATTR_TRAP:
-		SimDemonTrap(state, d->attr[i].level);
-		break;
-	    default:
-		break;
+    c = &f->cards[r];
+    if (HasAttr(c, ATTR_REFLECTION, NULL) ||
+	    HasAttr(c, ATTR_IMMUNITY, NULL))
+	dmg *= 3;
+    dmg = MIN(dmg, c->hp);
+    dprintf("Mana corrupt: %d dmg to %s.\n", dmg, c->name);
+    c->hp -= dmg;
+    if (c->hp == 0)
+	RemoveCard(state, c, 1);
+}
+
+/**
+ * Simulates the demon Destroy ability.
+ *
+ * @param	state		The simulator state.
+ * @param	level		Unused.
+ */
+static void SimDemonDestroy(State *state, int level)
+{
+    CardSet *f = &state->field;
+    int      r = 0;
+    Card    *c = NULL;
+
+    r = PickAliveCardFromSet(state, f);
+    if (r == -1)
+	return;
+
+    c = &f->cards[r];
+    dprintf("Destroy cast on %s.\n", c->name);
+    if (!HasAttr(c, ATTR_RESISTANCE, NULL) &&
+	    !HasAttr(c, ATTR_IMMUNITY, NULL)) {
+	c->hp = 0;
+	RemoveCard(state, c, 1);
+    } else {
+	dprintf("%s resisted Destroy.\n", c->name);
+    }
+}
+
+/**
+ * Simulates the demon Fire God ability.
+ *
+ * @param	state		The simulator state.
+ * @param	level		Damage per round to each card.
+ */
+static void SimDemonFireGod(State *state, int level)
+{
+    CardSet *f    = &state->field;
+    Attr     attr = { ATTR_FIRE_GOD, level };
+    int      j    = 0;
+
+    for (j=0;j<f->numCards;j++) {
+	Card *c = &f->cards[j];
+	if (c->hp <= 0)
+	    continue;
+	if (HasAttr(c, ATTR_IMMUNITY, NULL)) {
+	    dprintf("%s immune to Fire God.\n", c->name);
+	} else if (!HasAttr(c, ATTR_FIRE_GOD, NULL)) {
+	    dprintf("Fire God cast on %s.\n", c->name);
+	    AddAttr(c, &attr);
+	}
+    }
+}
+
+/**
+ * Simulates the demon Toxic clouds ability.
+ *
+ * @param	state		The simulator state.
+ * @param	level		Damage to each card now and next round.
+ */
+static void SimDemonToxicClouds(State *state, int level)
+{
+    CardSet *f    = &state->field;
+    Attr     attr = { ATTR_TOXIC_CLOUDS, level };
+    int      j    = 0;
+
+    for (j=0;j<f->numCards;j++) {
+	int dmg = level;
+	Card *c = &f->cards[j];
+
+	if (c->hp <= 0)
+	    continue;
+	if (HasAttr(c, ATTR_IMMUNITY, NULL)) {
+	    dprintf("%s immune to Toxic Clouds.\n", c->name);
+	    break;
+	}
+	dmg = MIN(dmg, c->hp);
+	c->hp -= dmg;
+	dprintf("Toxic clouds does %d dmg to %s "
+		"(%d hp left).\n", dmg, c->name, c->hp);
+	if (c->hp <= 0)
+	    RemoveCard(state, c, 1);
+	else if (!HasAttr(c, ATTR_TOXIC_CLOUDS, NULL))
+	    AddAttr(c, &attr);
+    }
+}
+
+/**
+ * Works out what the demon does from its abilities (see DemonProfile).
+ * This must be called whenever the demon changes, before any fights.
+ *
+ * @param	d		The demon.
+ */
+static void InitDemonProfile(const Card *d)
+{
+    DemonProfile *p = &demonProfile;
+    int           i = 0;
+
+    memset(p, 0, sizeof(*p));
+    for (i=0;i<d->numAttr;i++) {
+	DemonAbility func = NULL;
+
+	switch (d->attr[i].type) {
+	    case ATTR_CURSE:		func = SimDemonCurse;		break;
+	    case ATTR_DAMNATION:	func = SimDemonDamnation;	break;
+	    case ATTR_EXILE:		func = SimDemonExile;		break;
+	    case ATTR_SNIPE:		func = SimDemonSnipe;		break;
+	    case ATTR_MANA_CORRUPT:	func = SimDemonManaCorrupt;	break;
+	    case ATTR_DESTROY:		func = SimDemonDestroy;		break;
+	    case ATTR_FIRE_GOD:		func = SimDemonFireGod;		break;
+	    case ATTR_TOXIC_CLOUDS:	func = SimDemonToxicClouds;	break;
+	    case ATTR_TRAP:		func = SimDemonTrap;		break;
+	    default:			break;
+	}
+	if (func != NULL) {
+	    p->steps[p->numSteps].func  = func;
+	    p->steps[p->numSteps].level = d->attr[i].level;
+	    p->numSteps++;
 	}
     }
 
+    p->hotChase    = HasAttr(d, ATTR_HOT_CHASE,    &p->hotChaseLevel);
+    p->wickedLeech = HasAttr(d, ATTR_WICKED_LEECH, &p->wickedLeechLevel);
+    p->chainAttack = HasAttr(d, ATTR_CHAIN_ATTACK, &p->chainAttackLevel);
+    p->lacerate    = HasAttr(d, ATTR_LACERATE,     NULL);
+    if (HasAttr(d, ATTR_RETALIATION, &p->counterLevel))
+	p->numCountered = 2;
+    else if (HasAttr(d, ATTR_COUNTERATTACK, &p->counterLevel))
+	p->numCountered = 1;
+}
+
+/**
+ * Simulates the demon's round.
+ *
+ * @param	state		The simulator state.
+ */
+static void SimDemon(State *state)
+{
+    const DemonProfile *p = &demonProfile;
+    int                 i = 0;
+    Card               *d = &state->demon;
+
+    if (state->round < FIRST_DEMON_ROUND)
+	return;
+    else if (state->round == FIRST_DEMON_ROUND)
+	dprintf("%s appears.\n", d->name);
+
+    vprintf("%s's turn:\n", d->name);
+
+    // At round 51, the player starts taking unavoidable damage.
+    if (state->round >= FIRST_UNAVOIDABLE_ROUND) {
+	int dmg = UnavoidableDamage(state->round);
+
+	dmg = MIN(dmg, state->hp);
+	state->hp -= dmg;
+	dprintf("Player takes %d unavoidable damage (%d left)\n",
+		dmg, state->hp);
+    }
+
+    // Handle demon abilities.
+    for (i=0;i<p->numSteps;i++) {
+	if (state->hp <= 0)
+	    break;
+	p->steps[i].func(state, p->steps[i].level);
+    }
+
     if (state->hp > 0) {
-	int atk   = d->atk;
-	int level = 0;
+	int atk = d->atk;
 
 	// Handle demon attack buffs.
-	if (HasAttr(d, ATTR_HOT_CHASE, &level)) {
+	if (p->hotChase) {
 	    // Hot chase: adds attack for each card in graveyard.
-	    int numCards = state->grave.numCards;
+	    int level = p->hotChaseLevel * state->grave.numCards;
 
-	    level *= numCards;
 	    if (level > 0) {
 		atk += level;
 		dprintf("Hot Chase: Demon attack +%d (now %d).\n", level, atk);
@@ -1732,16 +2402,6 @@ static void SimDemon(State *state)
 	SimDemonAttack(state, atk);
     }
 
-#if 0
-    // Post attack abilities.
-    for (i=0;i<d->numAttr;i++) {
-	switch (d->attr[i].type) {
-	    default:
-		break;
-	}
-    }
-#endif
-
     RemoveDeadCards(state);
 }
 
@@ -1783,6 +2443,17 @@ static void PlayCardsFromDeck(State *state)
     if (d->numCards > 0) {
 	Card *c = &d->cards[d->numCards-1];
 
+	// The first numUnseen cards of the deck haven't been put in order yet
+	// (see RunSolve), so pick one of them at random.
+	if (d->numCards <= state->numUnseen) {
+	    int  r   = Rnd(state, STREAM_SHUFFLE, state->numUnseen);
+	    Card tmp = d->cards[r];
+
+	    d->cards[r] = *c;
+	    *c          = tmp;
+	    state->numUnseen--;
+	}
+
 	vprintf("%s dealt to hand.\n", c->name);
 	AddCardToSet(h, c);
 	RemoveCardFromSet(d, d->numCards-1);
@@ -1874,7 +2545,7 @@ static void CardPlayedToField(State *state, Card *c)
 	SimReincarnate(state, "QS Reincarnated", level);
 
     if (HasAttr(c, ATTR_SACRIFICE, &level) && f->numCards > 1) {
-	int    r = Rnd(state, f->numCards - 1);
+	int    r = Rnd(state, STREAM_PLAYER, f->numCards - 1);
 	Card *c2 = &f->cards[r];
 
 	if (HasAttr(c2, ATTR_IMMUNITY, NULL)) {
@@ -2088,7 +2759,7 @@ static int PickAliveCardFromSet(State *state, const CardSet *cs)
 
     // Now, count holds the number of alive cards on the field.
     // Pick a random one from that many.
-    r = Rnd(state, count);
+    r = Rnd(state, STREAM_DEMON, count);
 
     // Find that card, skipping over the ones that couldn't be reanimated.
     for (i=0;i<cs->numCards;i++) {
@@ -2140,7 +2811,7 @@ static int PickReanimatableCard(State *state)
 
     // Now, count holds the number of cards that can be reanimated.
     // Pick a random one from that many.
-    r = Rnd(state, count);
+    r = Rnd(state, STREAM_PLAYER, count);
 
     // Find that card, skipping over the ones that couldn't be reanimated.
     for (i=0;i<g->numCards;i++) {
@@ -2247,7 +2918,7 @@ static Card *FindLowestHpCard(State *state, CardSet *cs, bool mostDamaged)
     if (!mostDamaged)
 	r = numLowest-1;
     else
-	r = Rnd(state, numLowest);
+	r = Rnd(state, STREAM_PLAYER, numLowest);
     for (i=0;i<cs->numCards;i++) {
 	if (mostDamaged) {
 	    value = c->maxHp - c->hp;
@@ -2365,7 +3036,7 @@ static void SimPlayerAttack(State *state)
 		    dmg += increase;
 		    dprintf("Concentrate: dmg increased by %d to %d (AVG).\n",
 			    increase, dmg);
-		} else if (Rnd(state, 100) < 50) {
+		} else if (Chance(state, ROLL_CONCENTRATE, 50)) {
 		    increase = (baseAtk * level) / 100;
 		    dmg += increase;
 		    dprintf("Concentrate: dmg increased by %d to %d.\n",
@@ -2378,7 +3049,7 @@ static void SimPlayerAttack(State *state)
 		    dmg += increase;
 		    dprintf("Frost bite: dmg increased by %d to %d (AVG).\n",
 			    increase, dmg);
-		} else if (Rnd(state, 100) < 50) {
+		} else if (Chance(state, ROLL_CONCENTRATE, 50)) {
 		    increase = (baseAtk * level) / 100;
 		    dmg += increase;
 		    dprintf("Frost bite: dmg increased by %d to %d.\n",
@@ -2435,22 +3106,16 @@ static void SimPlayerAttack(State *state)
 
     // Check for demon counterattack or retaliation.
     {
-	int numCardsToCounter = 0;
 	int i   = 0;
 	int dmg = 0;
 
-	if (HasAttr(&state->demon, ATTR_RETALIATION, &level)) {
-	    numCardsToCounter = 2;
-	} else if (HasAttr(&state->demon, ATTR_COUNTERATTACK, &level)) {
-	    numCardsToCounter = 1;
-	}
-	for (i=0;i<numCardsToCounter;i++) {
+	for (i=0;i<demonProfile.numCountered;i++) {
 	    Card *c2 = &f->cards[i];
 	    if (f->numCards <= i)
 		break;
 	    if (c2->hp <= 0)
 		continue;
-	    dmg = MIN(level, c2->hp);
+	    dmg = MIN(demonProfile.counterLevel, c2->hp);
 	    c2->hp -= dmg;
 	    dprintf("Demon counterattack hits %s for %d dmg.\n", c2->name, dmg);
 	    if (c2->hp <= 0)
@@ -2463,8 +3128,8 @@ static void SimPlayerAttack(State *state)
 	return;
 
     // If the demon has wicked leech, handle that now.
-    if (HasAttr(&state->demon, ATTR_WICKED_LEECH, &level)) {
-	int atkLoss = (c->curBaseAtk * level) / 100;
+    if (demonProfile.wickedLeech) {
+	int atkLoss = (c->curBaseAtk * demonProfile.wickedLeechLevel) / 100;
 
 	c->atk        -= atkLoss;
 	c->curBaseAtk -= atkLoss;
@@ -2989,285 +3654,2425 @@ static void SimPlayer(State *state)
     RemoveDeadCards(state);
 }
 
+// Bits for the statuses put on a card by the demon or by its own abilities
+// (see PackedCard).
+enum packedStatus {
+    STATUS_TRAP		= 0x01,		// ATTR_TRAP_BUFF.
+    STATUS_LACERATE	= 0x02,		// ATTR_LACERATE_BUFF.
+    STATUS_TOXIC	= 0x04,		// ATTR_TOXIC_CLOUDS.
+    STATUS_FIRE_GOD	= 0x08,		// ATTR_FIRE_GOD.
+    STATUS_SICKNESS	= 0x10,		// ATTR_REANIM_SICKNESS.
+};
+
+// An attribute added to a card that isn't one of the statuses above (e.g.
+// a buff from another card or from a rune).
+typedef struct packedAttr {
+    unsigned char	type;
+    short		level;
+} PackedAttr;
+
+// The changing part of a card.  Everything else is the same as the card
+// type, which is given by its id.
+typedef struct packedCard {
+    unsigned short	type;			// Card id + 1, 0 if dead card.
+    unsigned char	timing;			// Current timing.
+    unsigned char	numExtra;		// Entries used in extra.
+    short		atk;
+    short		baseAtk;		// Current base atk.
+    short		hp;
+    short		maxHp;
+    unsigned short	status;			// STATUS_* bits.
+    PackedAttr		extra[MAX_PACKED_EXTRA];// Other added attributes.
+} PackedCard;
+
+// A compact, fixed size copy of everything about a state at the start of a
+// round that can affect the rest of the fight (see PackState).  Unlike the
+// State, it has no pointers and no unused space that isn't zero, so two
+// packed states can be compared and hashed as plain bytes.
+typedef struct packedState {
+    int			round;
+    int			hp;			// Player's current hp.
+    int			maxHp;			// Player's max hp.
+    int			demonAtk;
+    int			demonBaseAtk;		// Demon's current base atk.
+    unsigned char	numUnseen;		// See State.
+    unsigned char	numCards[4];		// Deck, hand, field, grave.
+    unsigned char	runesUsed;		// Bit for each usedThisRound.
+    unsigned char	charges[MAX_RUNES];	// Charges used of each rune.
+    PackedCard		demon;			// Demon status and buffs.
+    PackedCard		cards[MAX_CARDS_IN_DECK];// Cards of all sets.
+} PackedState;
+
 /**
- * Simulates one complete battle from round 1 to player death.
+ * Packs one card (see PackState).  The card's attributes must start with
+ * its base attributes, as they do after InitCard().  The statuses after
+ * them are kept as bits, since their order doesn't matter and their levels
+ * only depend on the demon, and any other attributes are kept in the
+ * order they were added.
  *
- * @param	state		The simulator state.
- * @param	localRoundX	This is the number of rounds specified by
- *				the -printround command line option.  If the
- *				battle goes on for this number of rounds, we
- *				set *hitRoundX to true.
- * @param	hitRoundX	Pointer to a bool.  We will set this to true
- *				if the battle reaches round X.
+ * @param	c		The card.
+ * @param	pc		Gets the packed card.
+ * @param	withStats	If false, the atk and hp aren't packed (used
+ *				for the demon, whose stats don't fit).
+ * @return			False if the card doesn't fit.
  */
-void Simulate(State *state, int localRoundX, bool *hitRoundX)
+static bool PackCard(const Card *c, PackedCard *pc, bool withStats)
 {
-    while (state->hp > 0 && (state->field.numCards > 0 ||
-	    state->deck.numCards > 0 || state->hand.numCards > 0) &&
-	    state->round <= maxRounds) {
-	if (state->round == localRoundX)
-	    *hitRoundX = true;
-	PrintState(state);
-	DecreaseTimers(state);
-	if ((state->round & 1) == 0) {
-	    dprintf("\nRound %d (player)\n\n", state->round);
-	    PlayCardsFromDeck(state);
-	    PlayCardsFromHand(state);
-	    // Check here because of obstinacy.
-	    if (state->hp <= 0)
-		break;
-	    SimPlayer(state);
-	} else {
-	    dprintf("\nRound %d (demon)\n\n", state->round);
-	    SimDemon(state);
+    const Card *type = NULL;
+    int         i    = 0;
+
+    if (c->id >= 0) {
+	type = &cardTypes[c->id];
+	// The -sensitivity variants change the base stats of a card.
+	if (c->timing != type->timing || c->baseAtk != type->baseAtk ||
+		c->baseHp != type->baseHp)
+	    return false;
+    }
+    if (c->curTiming < 0 || c->curTiming > 0xff)
+	return false;
+    pc->type   = c->id + 1;
+    pc->timing = c->curTiming;
+    if (withStats) {
+	if (c->atk != (short) c->atk || c->curBaseAtk != (short) c->curBaseAtk ||
+		c->hp != (short) c->hp || c->maxHp != (short) c->maxHp)
+	    return false;
+	pc->atk     = c->atk;
+	pc->baseAtk = c->curBaseAtk;
+	pc->hp      = c->hp;
+	pc->maxHp   = c->maxHp;
+    }
+
+    for (i=0;i<c->numBaseAttr;i++) {
+	if (i >= c->numAttr || c->attr[i].type != c->baseAttr[i].type ||
+		c->attr[i].level != c->baseAttr[i].level)
+	    return false;
+    }
+    for (;i<c->numAttr;i++) {
+	const Attr *a   = &c->attr[i];
+	int         bit = 0;
+
+	switch (a->type) {
+	    case ATTR_TRAP_BUFF:	bit = STATUS_TRAP;	break;
+	    case ATTR_LACERATE_BUFF:	bit = STATUS_LACERATE;	break;
+	    case ATTR_TOXIC_CLOUDS:	bit = STATUS_TOXIC;	break;
+	    case ATTR_FIRE_GOD:		bit = STATUS_FIRE_GOD;	break;
+	    case ATTR_REANIM_SICKNESS:	bit = STATUS_SICKNESS;	break;
+	    default:			break;
+	}
+	if (bit != 0 && !(pc->status & bit)) {
+	    pc->status |= bit;
+	    continue;
 	}
-	state->round++;
+	if (pc->numExtra >= MAX_PACKED_EXTRA)
+	    return false;
+	pc->extra[pc->numExtra].type  = a->type;
+	pc->extra[pc->numExtra].level = a->level;
+	pc->numExtra++;
     }
-    state->round--;
-    PrintState(state);
+    return true;
 }
 
 /**
- * Calculates the cost of the deck.  This affects the deck's cooldown.
- *
- * @return	Deck cost.
+ * Compares two packed cards, for qsort.
  */
-int CalcCost(void)
+static int ComparePackedCards(const void *a, const void *b)
 {
-    int         i    = 0;
-    int         cost = 0;
-    const Card *c    = NULL;
-    for (i=0;i<numDeckCards;i++) {
-	c = FindCard(theDeck[i]);
-	cost += c->cost;
-    }
-    return cost;
+    return memcmp(a, b, sizeof(PackedCard));
 }
 
 /**
- * Takes a string and strips spaces from the front and end of the string.
- * This is normally the strtrim() function but not every platform has it
- * so I had to write my own.
+ * Packs everything about a state at the start of a round that can affect
+ * the rest of the fight.  Two states with the same packing will go on to
+ * do the same amount of additional damage with the same probabilities.  The
+ * damage done so far and the demon's hp are left out since nothing depends
+ * on them, and the deck cards that aren't in order yet are sorted since
+ * their order doesn't matter.
+ *
+ * @param	state		The state.
+ * @param	ps		Gets the packed state.
+ * @return			False if the state doesn't fit (e.g. a card
+ *				with more than 32767 hp).
  */
-static char *trim(char *s)
+static bool PackState(const State *state, PackedState *ps)
 {
-    int len = 0;
+    const CardSet *sets[4];
+    int            n = 0;
+    int            i = 0;
+    int            j = 0;
+
+    sets[0] = &state->deck;
+    sets[1] = &state->hand;
+    sets[2] = &state->field;
+    sets[3] = &state->grave;
+
+    memset(ps, 0, sizeof(*ps));
+    ps->round        = state->round;
+    ps->hp           = state->hp;
+    ps->maxHp        = state->maxHp;
+    ps->demonAtk     = state->demon.atk;
+    ps->demonBaseAtk = state->demon.curBaseAtk;
+    ps->numUnseen    = state->numUnseen;
+    if (!PackCard(&state->demon, &ps->demon, false))
+	return false;
+
+    for (i=0;i<4;i++) {
+	if (n + sets[i]->numCards > DIM(ps->cards))
+	    return false;
+	ps->numCards[i] = sets[i]->numCards;
+	for (j=0;j<sets[i]->numCards;j++) {
+	    if (!PackCard(&sets[i]->cards[j], &ps->cards[n++], true))
+		return false;
+	}
+    }
+    qsort(ps->cards, state->numUnseen, sizeof(PackedCard), ComparePackedCards);
 
-    while (isspace((unsigned int) (*s)))
-	s++;
-    len = strlen(s);
-    while (len > 0 && isspace((unsigned int)(s[len-1])))
-	len--;
-    s[len] = '\0';
-    return s;
+    for (i=0;i<state->numRunes;i++) {
+	if (state->runes[i].chargesUsed > 0xff)
+	    return false;
+	ps->charges[i] = state->runes[i].chargesUsed;
+	if (state->runes[i].usedThisRound)
+	    ps->runesUsed |= 1 << i;
+    }
+    return true;
 }
 
 /**
- * Returns an allocated copy of a string.  This is normally the strdup()
- * function but not every platform has it so I had to write my own.
+ * Hashes a block of bytes.  This works like 64-bit FNV-1a, but on 8 bytes
+ * at a time for speed, with some extra mixing at the end.
+ *
+ * @param	key		The bytes.
+ * @param	len		The number of bytes.
+ * @return			The hash.
  */
-static char *my_strdup(const char *s)
+static unsigned long long HashBytes(const unsigned char *key, int len)
 {
-    int   len = strlen(s);
-    char *ret = (char *) malloc(len+1);
+    unsigned long long hash = 14695981039346656037ULL;
+    unsigned long long word = 0;
+    int                i    = 0;
+
+    for (i=0;i+8<=len;i+=8) {
+	memcpy(&word, &key[i], 8);
+	hash ^= word;
+	hash *= 1099511628211ULL;
+	hash ^= hash >> 32;
+    }
+    for (;i<len;i++) {
+	hash ^= key[i];
+	hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 32;
+    return hash;
+}
 
-    strcpy(ret, s);
-    return ret;
+/**
+ * Hashes a packed state.
+ *
+ * @param	ps		The packed state.
+ * @return			The hash.
+ */
+static unsigned long long HashPacked(const PackedState *ps)
+{
+    return HashBytes((const unsigned char *) ps, sizeof(*ps));
 }
 
 /**
- * Reads the cards.txt file to get all the card descriptions from that
- * file.  Fills in the cardTypes array.
+ * Checks whether a battle is over.  It ends when the player dies, runs out
+ * of cards, or reaches the maximum number of rounds.
  *
- * @param	filename	The name of the cards file (normally cards.txt).
+ * @param	state		The simulator state.
+ * @return			True if the battle is over.
  */
-static void readCardTypesFromFile(const char *filename)
+static bool FightOver(const State *state)
 {
-    static char buffer[MAX_LINE_SIZE];
-    FILE *f       = NULL;
-    char *trimmed = NULL;
-    char *s       = NULL;
-    bool  error   = false;
-    int   attr    = 0;
-    Card *c       = NULL;
+    return !(state->hp > 0 && (state->field.numCards > 0 ||
+	    state->deck.numCards > 0 || state->hand.numCards > 0) &&
+	    state->round <= maxRounds);
+}
 
-    f = fopen(filename, "r");
-    if (f == NULL) {
-	fprintf(stderr, "Error: Couldn't read file %s.\n", filename);
-	exit(1);
+/**
+ * Simulates one round of a battle.  If the player dies from obstinacy, the
+ * round number is not advanced.
+ *
+ * @param	state		The simulator state.
+ */
+static void SimRound(State *state)
+{
+    PrintState(state);
+    DecreaseTimers(state);
+    if ((state->round & 1) == 0) {
+	dprintf("\nRound %d (player)\n\n", state->round);
+	PlayCardsFromDeck(state);
+	PlayCardsFromHand(state);
+	// Check here because of obstinacy.
+	if (state->hp <= 0)
+	    return;
+	SimPlayer(state);
+    } else {
+	dprintf("\nRound %d (demon)\n\n", state->round);
+	SimDemon(state);
     }
-    numCardTypes = 0;
-    while (fgets(buffer, MAX_LINE_SIZE, f) != NULL) {
-	buffer[MAX_LINE_SIZE-1] = '\0';
-	trimmed = trim(buffer);
-	if (trimmed[0] == '#' || trimmed[0] == '\0')
-	    continue;
+    state->round++;
+}
 
-	c = &cardTypes[numCardTypes];
+// A player round seen by SkipCycles.
+typedef struct cycleMark {
+    unsigned int	quick;		// See QuickSum().
+    int			round;
+    int			hp;
+    int			dmgDone;
+    int			numRolls;
+} CycleMark;
+
+// The player rounds of a battle that were checked for a cycle.  Rounds are
+// checked CYCLE_WINDOW player rounds in a row, then there is a gap that
+// doubles each time.  Once a battle settles into a cycle it stays there, so
+// this finds it soon enough without spending much time on battles that
+// never do.
+typedef struct cycleRing {
+    int			numMarks;
+    int			next;		// Slot for the next mark.
+    int			numChecks;	// Rounds checked.
+    int			nextCheck;	// Next round to check.
+    int			gap;		// Rounds to skip after a window.
+    bool		done;		// Stop looking.
+    bool		pending;	// A possible cycle is being confirmed.
+    CycleMark		start;		// Start of the possible cycle.
+    unsigned long long	hash;		// Hash of the state at its start.
+    int			confirmRound;	// Round where it would repeat.
+    CycleMark		marks[MAX_CYCLE_ROUNDS / 2];
+} CycleRing;
 
-	// Name
-	s = strtok(trimmed, ",");
-	if (s == NULL) {
-	    fprintf(stderr, "Bad card description: %s\n", trimmed);
-	    exit(1);
-	}
-	c->name = my_strdup(trim(s));
-
-	// Cost
-	s = strtok(NULL, ",");
-	if (s == NULL) { error = true; break; }
-	c->cost = strtoul(trim(s), NULL, 0);
-	if (c->cost == 0) {
-	    fprintf(stderr, "Bad cost: %s\n", trim(s));
-	    error = true;
-	    break;
+/**
+ * Checks whether the player's hp can change what happens in a round, other
+ * than by ending the battle.  This is the case for Prayer (which can't heal
+ * past max hp) and for the Tsunami rune (which activates at half hp).
+ *
+ * @param	state		The simulator state.
+ * @return			True if the player's hp matters.
+ */
+static bool HpMatters(const State *state)
+{
+    const CardSet *sets[4];
+    int            i = 0;
+    int            j = 0;
+
+    sets[0] = &state->deck;
+    sets[1] = &state->hand;
+    sets[2] = &state->field;
+    sets[3] = &state->grave;
+    for (i=0;i<DIM(sets);i++) {
+	for (j=0;j<sets[i]->numCards;j++) {
+	    const Card *c = &sets[i]->cards[j];
+
+	    if (HasAttr(c, ATTR_PRAYER, NULL) ||
+		    HasAttr(c, ATTR_QS_PRAYER, NULL))
+		return true;
 	}
+    }
+    for (i=0;i<state->numRunes;i++) {
+	const Rune *rune = &state->runes[i];
 
-	// Timing
-	s = strtok(NULL, ",");
-	if (s == NULL) { error = true; break; }
-	c->timing = strtoul(trim(s), NULL, 0);
-	if (c->timing == 0) {
-	    fprintf(stderr, "Bad timing: %s\n", trim(s));
-	    error = true;
-	    break;
+	if (rune->attr.type == ATTR_TSUNAMI &&
+		rune->chargesUsed < rune->maxCharges)
+	    return true;
+    }
+    return false;
+}
+
+/**
+ * Returns the total unavoidable damage from round first up to (but not
+ * including) round last.
+ */
+static int UnavoidableBetween(int first, int last)
+{
+    int total = 0;
+    int round = 0;
+
+    for (round=first;round<last;round++) {
+	if (round & 1)
+	    total += UnavoidableDamage(round);
+    }
+    return total;
+}
+
+/**
+ * Returns a quick checksum of the parts of the state that change the most
+ * from round to round.  Two states with different checksums can't be the
+ * same, so the full hash only needs to be computed when they match.
+ *
+ * @param	state		The simulator state.
+ * @return			The checksum.
+ */
+static unsigned int QuickSum(const State *state)
+{
+    const CardSet *f   = &state->field;
+    const CardSet *h   = &state->hand;
+    unsigned int   sum = state->deck.numCards;
+    int            i   = 0;
+
+    sum = sum * 31 + h->numCards;
+    sum = sum * 31 + f->numCards;
+    sum = sum * 31 + state->grave.numCards;
+    sum = sum * 31 + state->demon.atk;
+    for (i=0;i<f->numCards;i++) {
+	sum = sum * 31 + f->cards[i].hp;
+	sum = sum * 31 + f->cards[i].atk;
+    }
+    for (i=0;i<h->numCards;i++)
+	sum = sum * 31 + h->cards[i].curTiming;
+    return sum;
+}
+
+/**
+ * Hashes everything about the state that can affect the rest of the battle,
+ * except for the player's hp and the round number.
+ *
+ * @param	state		The simulator state.
+ * @param	hash		Gets the hash.
+ * @return			False if the state can't be packed.
+ */
+static bool CycleHash(const State *state, unsigned long long *hash)
+{
+    PackedState ps;
+
+    if (!PackState(state, &ps))
+	return false;
+    ps.round = 0;
+    ps.hp    = 0;
+    *hash    = HashPacked(&ps);
+    return true;
+}
+
+/**
+ * Late in a battle, the cards often settle into a pattern that repeats
+ * every few rounds, where only the player's hp changes.  This function
+ * looks for such a cycle at the start of player rounds, and when it finds
+ * one, skips ahead by as many whole cycles as the player survives, adding
+ * the damage of each skipped cycle.
+ *
+ * A cycle is found when the state (other than hp, damage and round) is the
+ * same as a few rounds ago, and no random numbers were used since then.
+ * The only thing that differs from one cycle to the next is then the
+ * unavoidable damage, which depends on the round.  A possible cycle is
+ * first spotted with QuickSum(), and then confirmed by checking that the
+ * full hash of the state is the same one cycle later.  The rest of the
+ * battle after the skipped cycles is simulated normally.
+ *
+ * @param	state		The simulator state.
+ * @param	ring		The checked player rounds.
+ * @param	localRoundX	See Simulate().
+ * @param	hitRoundX	See Simulate().
+ */
+static void SkipCycles(State *state, CycleRing *ring, int localRoundX,
+	bool *hitRoundX)
+{
+    CycleMark         *mark    = NULL;
+    CycleMark          now;
+    unsigned long long hash    = 0;
+    int                i       = 0;
+    int                period  = 0;
+    int                dmg     = 0;
+    int                loss    = 0;
+    int                round   = state->round;
+    int                hp      = state->hp;
+    int                skipped = 0;
+
+    if (ring->done || (state->round & 1) || state->round < ring->nextCheck)
+	return;
+    ring->numChecks++;
+    if (ring->numChecks % CYCLE_WINDOW == 0) {
+	ring->nextCheck = state->round + ring->gap;
+	ring->gap      *= 2;
+    } else {
+	ring->nextCheck = state->round + 2;
+    }
+
+    now.quick    = QuickSum(state);
+    now.round    = state->round;
+    now.hp       = state->hp;
+    now.dmgDone  = state->dmgDone;
+    now.numRolls = state->numRolls;
+
+    if (ring->pending) {
+	ring->pending = false;
+	if (state->numRolls == ring->start.numRolls &&
+		CycleHash(state, &hash) && hash == ring->hash) {
+	    mark = &ring->start;
 	}
+    }
 
-	// Base atk
-	s = strtok(NULL, ",");
-	if (s == NULL) { error = true; break; }
-	c->baseAtk = strtoul(trim(s), NULL, 0);
-	if (c->baseAtk == 0) {
-	    fprintf(stderr, "Bad attack: %s\n", trim(s));
-	    error = true;
-	    break;
+    if (mark == NULL) {
+	// Look at the most recent marks first, for the shortest cycle.
+	for (i=1;i<=ring->numMarks;i++) {
+	    CycleMark *m = &ring->marks[(ring->next + DIM(ring->marks) - i) %
+					DIM(ring->marks)];
+
+	    if (m->quick == now.quick && m->numRolls == now.numRolls &&
+		    CycleHash(state, &hash)) {
+		ring->pending      = true;
+		ring->start        = now;
+		ring->hash         = hash;
+		ring->confirmRound = state->round + (state->round - m->round);
+		ring->nextCheck    = ring->confirmRound;
+		break;
+	    }
 	}
+	ring->marks[ring->next] = now;
+	ring->next     = (ring->next + 1) % DIM(ring->marks);
+	ring->numMarks = MIN(ring->numMarks + 1, DIM(ring->marks));
+	return;
+    }
 
-	// Base hp
-	s = strtok(NULL, ",");
-	if (s == NULL) { error = true; break; }
-	c->baseHp = strtoul(trim(s), NULL, 0);
-	if (c->baseHp == 0) {
-	    fprintf(stderr, "Bad hp: %s\n", trim(s));
-	    error = true;
+    // Only skip ahead once per battle.
+    ring->done = true;
+    if (HpMatters(state))
+	return;
+
+    period = state->round - mark->round;
+    dmg    = state->dmgDone - mark->dmgDone;
+    loss   = (mark->hp - state->hp) -
+	     UnavoidableBetween(mark->round, state->round);
+    while (round + period <= maxRounds + 1) {
+	int next = hp - loss - UnavoidableBetween(round, round + period);
+
+	if (next <= 0)
 	    break;
+	hp     = next;
+	round += period;
+	skipped++;
+    }
+    if (skipped == 0)
+	return;
+
+    if (localRoundX > state->round && localRoundX < round)
+	*hitRoundX = true;
+    state->round      = round;
+    state->hp         = hp;
+    state->dmgDone   += skipped * dmg;
+    state->demon.hp  -= skipped * dmg;
+}
+
+/**
+ * Simulates one complete battle from round 1 to player death.
+ *
+ * @param	state		The simulator state.
+ * @param	localRoundX	This is the number of rounds specified by
+ *				the -printround command line option.  If the
+ *				battle goes on for this number of rounds, we
+ *				set *hitRoundX to true.
+ * @param	hitRoundX	Pointer to a bool.  We will set this to true
+ *				if the battle reaches round X.
+ */
+void Simulate(State *state, int localRoundX, bool *hitRoundX)
+{
+    CycleRing ring;
+    bool      skip = !noCycles && !doDebug && state->fork == NULL;
+
+    memset(&ring, 0, sizeof(ring));
+    ring.nextCheck = FIRST_CYCLE_ROUND;
+    ring.gap       = 2 * MAX_CYCLE_ROUNDS;
+    while (!FightOver(state)) {
+	if (state->round == localRoundX)
+	    *hitRoundX = true;
+	if (skip) {
+	    SkipCycles(state, &ring, localRoundX, hitRoundX);
+	    if (FightOver(state))
+		break;
+	    if (state->round == localRoundX)
+		*hitRoundX = true;
 	}
+	SimRound(state);
+    }
+    state->round--;
+    PrintState(state);
+}
 
-	// Attributes
-	attr = 0;
-	do {
-	    int   attrType = 0;
-	    char *colon    = NULL;
-	    int   value    = 0;
+// The lane engine runs NUM_LANES fights side by side, one round at a time
+// in all of them (lockstep).  It only handles simple decks (see
+// LaneDeckFits), but for those it keeps just the few numbers that can change
+// during a fight, with each one stored as an array over the lanes.  Each
+// lane is still played on its own by LanePlayCards, LaneAttack and
+// LaneDemonAttack, which branch on that lane's data, so this is a
+// specialized scalar engine rather than a vector one.  It is faster because
+// it doesn't copy and scan the full State of each fight.  The fights use
+// the same random numbers as Simulate, so the results are exactly the same.
+
+// Races, in the order that CardPlayedToField checks them, with their guard
+// and force abilities.
+static const int laneRaces[4] = {
+    ATTR_TUNDRA, ATTR_FOREST, ATTR_MTN, ATTR_SWAMP
+};
+static const int laneHpBuffs[4] = {
+    ATTR_TUNDRA_HP, ATTR_FOREST_HP, ATTR_MTN_HP, ATTR_SWAMP_HP
+};
+static const int laneAtkBuffs[4] = {
+    ATTR_TUNDRA_ATK, ATTR_FOREST_ATK, ATTR_MTN_ATK, ATTR_SWAMP_ATK
+};
 
-	    s = strtok(NULL, ",");
-	    if (s == NULL)
+// What a card of the initial deck does, worked out from its abilities.
+typedef struct laneCard {
+    int		timing;
+    int		atk;
+    int		baseAtk;
+    int		hp;
+    int		race;			// Index in laneRaces, or -1.
+    int		dodge;			// Dodge chance, or -1.
+    int		concentrate;		// Concentrate or frost bite, or -1.
+    int		parry;
+    int		craze;
+    int		bloodsucker;
+    int		regenerate;
+    bool	immune;
+    int		hitDmg;			// Counterattack and retaliation.
+    int		hpBuff[4];		// Guard given to each race.
+    int		atkBuff[4];		// Force given to each race.
+} LaneCard;
+
+// The fights of the lane engine.  Cards are referred to by their index in
+// the initial deck.  Everything that changes is indexed by lane last.
+typedef struct laneBatch {
+    LaneCard		types[MAX_CARDS_IN_SET];
+    int			demonAtk;
+    int			demonParry;
+    int			startRound;
+    bool		done[NUM_LANES];
+    bool		hitRoundX[NUM_LANES];
+    bool		antithetic[NUM_LANES];
+    int			endRound[NUM_LANES];
+    int			hp[NUM_LANES];
+    int			dmgDone[NUM_LANES];
+    int			numRolls[NUM_LANES];
+    int			rollExcess[NUM_ROLL_TYPES][NUM_LANES];
+    double		weight[NUM_LANES];
+    unsigned int	seedW[NUM_STREAMS][NUM_LANES];
+    unsigned int	seedZ[NUM_STREAMS][NUM_LANES];
+    int			numDeck[NUM_LANES];
+    int			numUnseen[NUM_LANES];
+    int			numHand[NUM_LANES];
+    int			numField[NUM_LANES];
+    int			numGrave[NUM_LANES];
+    signed char		deck[MAX_CARDS_IN_SET][NUM_LANES];
+    signed char		hand[MAX_CARDS_IN_HAND][NUM_LANES];
+    int			timing[MAX_CARDS_IN_HAND][NUM_LANES];
+    signed char		field[MAX_CARDS_IN_SET][NUM_LANES];	// -1 if dead.
+    int			atk[MAX_CARDS_IN_SET][NUM_LANES];
+    int			baseAtk[MAX_CARDS_IN_SET][NUM_LANES];
+    int			cardHp[MAX_CARDS_IN_SET][NUM_LANES];
+    int			maxHp[MAX_CARDS_IN_SET][NUM_LANES];
+    bool		immune[MAX_CARDS_IN_SET][NUM_LANES];
+    int			fireGod[MAX_CARDS_IN_SET][NUM_LANES];	// -1 if none.
+    int			toxic[MAX_CARDS_IN_SET][NUM_LANES];	// -1 if none.
+} LaneBatch;
+
+/**
+ * Works out what a deck card does for the lane engine.
+ *
+ * @param	c		The card.
+ * @param	lc		Returns what the card does.
+ * @return			False if the card has an ability that the
+ *				lane engine doesn't handle.
+ */
+static bool LaneCardFits(const Card *c, LaneCard *lc)
+{
+    int i = 0;
+    int j = 0;
+
+    memset(lc, 0, sizeof(*lc));
+    lc->timing      = c->curTiming;
+    lc->atk         = c->atk;
+    lc->baseAtk     = c->curBaseAtk;
+    lc->hp          = c->hp;
+    lc->race        = -1;
+    lc->dodge       = -1;
+    lc->concentrate = -1;
+    if (c->hp <= 0 || c->hp != c->maxHp)
+	return false;
+
+    for (i=0;i<c->numAttr;i++) {
+	int type  = c->attr[i].type;
+	int level = c->attr[i].level;
+
+	switch (type) {
+	    case ATTR_DODGE:
+		if (lc->dodge >= 0)
+		    return false;
+		lc->dodge = level;
+		continue;
+	    case ATTR_CONCENTRATE:
+	    case ATTR_FROST_BITE:
+		if (lc->concentrate >= 0)
+		    return false;
+		lc->concentrate = level;
+		continue;
+	    case ATTR_PARRY:
+		lc->parry += level;
+		continue;
+	    case ATTR_CRAZE:
+		lc->craze += level;
+		continue;
+	    case ATTR_BLOODSUCKER:
+		if (lc->bloodsucker != 0)
+		    return false;
+		lc->bloodsucker = level;
+		continue;
+	    case ATTR_COUNTERATTACK:
+	    case ATTR_RETALIATION:
+		lc->hitDmg += level;
+		continue;
+	    case ATTR_REGENERATE:
+		lc->regenerate += level;
+		continue;
+	    case ATTR_IMMUNITY:
+		lc->immune = true;
+		continue;
+	    default:
+		break;
+	}
+	for (j=0;j<4;j++) {
+	    if (type == laneRaces[j]) {
+		// CardPlayedToField and AddBuffToField only agree on the
+		// race of a card that has one.
+		if (lc->race >= 0)
+		    return false;
+		lc->race = j;
 		break;
-	    s = trim(s);
-	    colon = strchr(s, ':');
-	    if (colon) {
-		*colon = '\0';
-		value = strtoul(colon+1, NULL, 0);
 	    }
-	    attrType = LookupAttr(s);
-	    if (attrType == -1) {
-		fprintf(stderr, "Bad attribute: %s not found\n", s);
-		error = true;
+	    // A card only receives the first of several buffs of a kind.
+	    if (type == laneHpBuffs[j]) {
+		if (lc->hpBuff[j] != 0 || level <= 0)
+		    return false;
+		lc->hpBuff[j] = level;
 		break;
 	    }
-	    c->baseAttr[attr].type  = attrType;
-	    c->baseAttr[attr].level = value;
-	    attr++;
-	} while (attr < MAX_ATTR-1);
-	if (error)
-	    break;
-	cardTypes[numCardTypes].baseAttr[attr].type = ATTR_NONE;
-	numCardTypes++;
-    }
-    if (error) {
-	fprintf(stderr, "Bad card description: %s\n",
-		cardTypes[numCardTypes].name);
-	exit(1);
+	    if (type == laneAtkBuffs[j]) {
+		if (lc->atkBuff[j] != 0 || level <= 0)
+		    return false;
+		lc->atkBuff[j] = level;
+		break;
+	    }
+	}
+	if (j == 4)
+	    return false;
     }
-    fclose(f);
+    return true;
 }
 
 /**
- * Reads the deck description from a file.  Fills in theDeck array and
- * theRunes array.
+ * Checks whether the fights from a state can be run by the lane engine, and
+ * sets up the parts of the batch that are the same for every fight.  The
+ * deck can only have cards whose abilities are races, dodge, parry,
+ * concentrate, frost bite, craze, bloodsucker, counterattack, retaliation,
+ * regenerate, immunity, guard and force.  There can't be any runes, and the
+ * demon can only have curse, damnation, fire god, toxic clouds,
+ * counterattack, retaliation, hot chase and parry.
  *
- * @param	filename	Filename of deck file.
+ * @param	b		The lane batch to set up.
+ * @param	initial		The state the fights start from.
+ * @return			True if the lane engine can be used.
  */
-static void readDeckFromFile(const char *filename)
+static bool LaneDeckFits(LaneBatch *b, const State *initial)
 {
-    static char buffer[MAX_LINE_SIZE];
-    FILE *f       = NULL;
-    char *trimmed = NULL;
+    const Card *d = &initial->demon;
+    int         i = 0;
 
-    f = fopen(filename, "r");
-    if (f == NULL) {
-	fprintf(stderr, "Error: Couldn't read file %s.\n", filename);
-	exit(1);
+    if (initial->numRunes != 0 || initial->numUnseen != 0 ||
+	    initial->hand.numCards != 0 || initial->field.numCards != 0)
+	return false;
+    for (i=0;i<initial->deck.numCards;i++) {
+	if (!LaneCardFits(&initial->deck.cards[i], &b->types[i]))
+	    return false;
     }
-    numDeckCards = 0;
-    numRunes = 0;
-    while (fgets(buffer, MAX_LINE_SIZE, f) != NULL) {
-	buffer[MAX_LINE_SIZE-1] = '\0';
-	trimmed = trim(buffer);
-	if (trimmed[0] == '#' || trimmed[0] == '\0')
-	    continue;
-	if (FindCard(trimmed) != NULL) {
-	    // Found a card.
-	    if (numDeckCards >= MAX_CARDS_IN_DECK) {
-		fprintf(stderr, "Error: Too many cards in deck.\n");
-		exit(1);
-	    }
-	    theDeck[numDeckCards++] = my_strdup(trimmed);
-	} else if (FindRune(trimmed) != NULL) {
-	    // Found a rune.
-	    if (numRunes >= MAX_RUNES) {
-		fprintf(stderr, "Error: Too many runes.\n");
-		exit(1);
-	    }
-	    theRunes[numRunes++] = my_strdup(trimmed);
-	} else {
-	    fprintf(stderr, "Error: Unknown card/rune %s.\n", trimmed);
-	    exit(1);
+
+    b->demonAtk   = d->atk;
+    b->demonParry = 0;
+    b->startRound = initial->round;
+    for (i=0;i<d->numAttr;i++) {
+	switch (d->attr[i].type) {
+	    case ATTR_CURSE:
+	    case ATTR_DAMNATION:
+	    case ATTR_FIRE_GOD:
+	    case ATTR_TOXIC_CLOUDS:
+	    case ATTR_COUNTERATTACK:
+	    case ATTR_RETALIATION:
+	    case ATTR_HOT_CHASE:
+		break;
+	    case ATTR_PARRY:
+		b->demonParry += d->attr[i].level;
+		break;
+	    default:
+		return false;
 	}
     }
-    fclose(f);
+    return true;
 }
 
 /**
- * Handles command line arguments.
+ * Returns a random number in the given range for one lane.  This is the
+ * same as Rnd (without -fork).
+ *
+ * @param	b		The lane batch.
+ * @param	l		The lane.
+ * @param	stream		The random number stream (e.g. STREAM_SHUFFLE).
+ * @param	range		Range of random number.
+ * @return			A random number in the range [0..range-1].
  */
-static void HandleArgs(int argc, char **argv)
+static unsigned int LaneRnd(LaneBatch *b, int l, int stream,
+	unsigned int range)
 {
-    int i = 0;
+    unsigned int *w = &b->seedW[stream][l];
+    unsigned int *z = &b->seedZ[stream][l];
+    unsigned int  r = 0;
+
+    *w = 18000*(*w & 65535) + (*w >> 16);
+    *z = 36969*(*z & 65535) + (*z >> 16);
+    r  = ((*z << 16) + *w) % range;
+    if (range > 1)
+	b->numRolls[l]++;
+    if (b->antithetic[l])
+	r = range - 1 - r;
+    return r;
+}
 
-    for (i=1;i<argc;i++) {
-	if (!strcasecmp(argv[i], "-level")) {
-	    i++;
-	    if (i < argc) {
-		initialLevel = strtoul(argv[i], NULL, 0);
-		if (initialLevel <= 0 || initialLevel > MAX_LEVEL) {
-		    fprintf(stderr, "Bad level: %d\n", initialLevel);
-		    exit(1);
-		}
-		initialHp = hpPerLevel[initialLevel];
-	    }
-	} else if (!strcasecmp(argv[i], "-hp")) {
-	    i++;
-	    if (i < argc)
-		initialHp = strtoul(argv[i], NULL, 0);
-	} else if (!strcasecmp(argv[i], "-iter")) {
-	    i++;
-	    if (i < argc)
-		numIters = strtoul(argv[i], NULL, 0);
-	} else if (!strcasecmp(argv[i], "-demon")) {
+/**
+ * Makes a random yes/no decision for one lane.  This is the same as Chance
+ * (without -fork).
+ *
+ * @param	b		The lane batch.
+ * @param	l		The lane.
+ * @param	rollType	The kind of decision (e.g. ROLL_DODGE).
+ * @param	percent		The chance of success, from 0 to 100.
+ * @return			True on success.
+ */
+static bool LaneChance(LaneBatch *b, int l, int rollType, int percent)
+{
+    bool hit    = false;
+    int  tilted = percent;
+
+    if (tiltPercent[rollType] != 0 && percent > 0 && percent < 100)
+	tilted = MIN(MAX(percent + tiltPercent[rollType], 1), 99);
+
+    hit = ((int) LaneRnd(b, l, rollType, 100) < tilted);
+    if (tilted != percent) {
+	if (hit)
+	    b->weight[l] *= (double) percent / tilted;
+	else
+	    b->weight[l] *= (double) (100 - percent) / (100 - tilted);
+    }
+    b->rollExcess[rollType][l] += (hit ? 100 : 0) - percent;
+    return hit;
+}
+
+/**
+ * Sets up one lane to run a fight, the same way ThreadSimulate sets up a
+ * State.
+ *
+ * @param	b		The lane batch.
+ * @param	l		The lane.
+ * @param	task		The task the fight belongs to.
+ * @param	i		The index of the fight in the task.
+ * @param	scratch		A state used to seed the rng.
+ */
+static void LaneStart(LaneBatch *b, int l, const Task *task, int i,
+	State *scratch)
+{
+    const State *initial  = task->initial;
+    int          fightNum = task->firstFight + i;
+    int          n        = initial->deck.numCards;
+    int          k        = 0;
+
+    b->antithetic[l] = false;
+    if (task->antithetic) {
+	SeedFight(scratch, fightNum >> 1);
+	b->antithetic[l] = (fightNum & 1);
+    } else {
+	SeedFight(scratch, fightNum);
+    }
+    for (k=0;k<NUM_STREAMS;k++) {
+	b->seedW[k][l] = scratch->seedW[k];
+	b->seedZ[k][l] = scratch->seedZ[k];
+    }
+    for (k=0;k<NUM_ROLL_TYPES;k++)
+	b->rollExcess[k][l] = initial->rollExcess[k];
+    b->weight[l]    = 1.0;
+    b->done[l]      = false;
+    b->hitRoundX[l] = false;
+    b->hp[l]        = initial->hp;
+    b->dmgDone[l]   = initial->dmgDone;
+    b->numDeck[l]   = n;
+    b->numHand[l]   = 0;
+    b->numField[l]  = 0;
+    b->numGrave[l]  = initial->grave.numCards;
+
+    // Same as SetDeckOrder and ShuffleCards, or a deck left unseen to be
+    // dealt at random.
+    b->numUnseen[l] = 0;
+    for (k=0;k<n;k++) {
+	if (task->orders != NULL)
+	    b->deck[k][l] = task->orders[(size_t) i * n + k];
+	else
+	    b->deck[k][l] = k;
+    }
+    if (task->orders != NULL) {
+	n = task->numShuffled;
+    } else if (!fullShuffle) {
+	b->numUnseen[l] = n;
+	n = 0;
+    }
+    for (k=0;k<n-1;k++) {
+	unsigned int r = LaneRnd(b, l, STREAM_SHUFFLE, n - k);
+
+	if (r != 0) {
+	    signed char tmp = b->deck[k][l];
+	    b->deck[k][l]   = b->deck[k+r][l];
+	    b->deck[k+r][l] = tmp;
+	}
+    }
+    b->numRolls[l] = 0;
+}
+
+/**
+ * Kills a card in one lane.  Like RemoveCard, this removes the guard and
+ * force buffs it gave and leaves a dead placeholder on the field.
+ *
+ * @param	b		The lane batch.
+ * @param	l		The lane.
+ * @param	s		The field slot of the card.
+ */
+static void LaneKill(LaneBatch *b, int l, int s)
+{
+    const LaneCard *t = &b->types[b->field[s][l]];
+    int             i = 0;
+
+    b->cardHp[s][l] = 0;
+    b->field[s][l]  = -1;
+    for (i=0;i<b->numField[l];i++) {
+	int k = b->field[i][l];
+	int r = 0;
+
+	if (k < 0 || b->types[k].race < 0)
+	    continue;
+	r = b->types[k].race;
+	b->maxHp[i][l]  -= t->hpBuff[r];
+	b->cardHp[i][l]  = MIN(b->cardHp[i][l], b->maxHp[i][l]);
+	b->atk[i][l]     = MAX(b->atk[i][l] - t->atkBuff[r], 0);
+	b->baseAtk[i][l] = MAX(b->baseAtk[i][l] - t->atkBuff[r], 0);
+    }
+    b->numGrave[l]++;
+}
+
+/**
+ * Removes the dead cards from the field of one lane.
+ *
+ * @param	b		The lane batch.
+ * @param	l		The lane.
+ */
+static void LaneRemoveDead(LaneBatch *b, int l)
+{
+    int i = 0;
+    int n = 0;
+
+    for (i=0;i<b->numField[l];i++) {
+	if (b->field[i][l] < 0)
+	    continue;
+	if (n != i) {
+	    b->field[n][l]   = b->field[i][l];
+	    b->atk[n][l]     = b->atk[i][l];
+	    b->baseAtk[n][l] = b->baseAtk[i][l];
+	    b->cardHp[n][l]  = b->cardHp[i][l];
+	    b->maxHp[n][l]   = b->maxHp[i][l];
+	    b->immune[n][l]  = b->immune[i][l];
+	    b->fireGod[n][l] = b->fireGod[i][l];
+	    b->toxic[n][l]   = b->toxic[i][l];
+	}
+	n++;
+    }
+    b->numField[l] = n;
+}
+
+/**
+ * Plays a card to the field of one lane, with the same guard and force
+ * buffs as CardPlayedToField.
+ *
+ * @param	b		The lane batch.
+ * @param	l		The lane.
+ * @param	k		The card (index in the initial deck).
+ */
+static void LanePlayCard(LaneBatch *b, int l, int k)
+{
+    const LaneCard *t = &b->types[k];
+    int             s = b->numField[l]++;
+    int             i = 0;
+
+    b->field[s][l]   = k;
+    b->atk[s][l]     = t->atk;
+    b->baseAtk[s][l] = t->baseAtk;
+    b->cardHp[s][l]  = t->hp;
+    b->maxHp[s][l]   = t->hp;
+    b->immune[s][l]  = t->immune;
+    b->fireGod[s][l] = -1;
+    b->toxic[s][l]   = -1;
+    for (i=0;i<s;i++) {
+	const LaneCard *t2 = NULL;
+
+	if (b->field[i][l] < 0)
+	    continue;
+	t2 = &b->types[b->field[i][l]];
+	if (t->race >= 0) {
+	    b->cardHp[s][l]  += t2->hpBuff[t->race];
+	    b->maxHp[s][l]   += t2->hpBuff[t->race];
+	    b->atk[s][l]     += t2->atkBuff[t->race];
+	    b->baseAtk[s][l] += t2->atkBuff[t->race];
+	}
+	if (t2->race >= 0) {
+	    b->cardHp[i][l]  += t->hpBuff[t2->race];
+	    b->maxHp[i][l]   += t->hpBuff[t2->race];
+	    b->atk[i][l]     += t->atkBuff[t2->race];
+	    b->baseAtk[i][l] += t->atkBuff[t2->race];
+	}
+    }
+}
+
+/**
+ * Plays cards in one lane at the start of the player's round: a card is
+ * dealt from the end of the deck, then the cards that are ready are played
+ * to the field.
+ *
+ * @param	b		The lane batch.
+ * @param	l		The lane.
+ */
+static void LanePlayCards(LaneBatch *b, int l)
+{
+    int i = 0;
+    int n = 0;
+
+    if (b->numDeck[l] > 0 && b->numHand[l] < MAX_CARDS_IN_HAND) {
+	int k = 0;
+
+	// Same as PlayCardsFromDeck for a deck that hasn't been put in order.
+	if (b->numDeck[l] <= b->numUnseen[l]) {
+	    int         r   = LaneRnd(b, l, STREAM_SHUFFLE, b->numUnseen[l]);
+	    signed char tmp = b->deck[r][l];
+
+	    b->deck[r][l]               = b->deck[b->numDeck[l]-1][l];
+	    b->deck[b->numDeck[l]-1][l] = tmp;
+	    b->numUnseen[l]--;
+	}
+	k = b->deck[--b->numDeck[l]][l];
+
+	n = b->numHand[l]++;
+	b->hand[n][l]   = k;
+	b->timing[n][l] = b->types[k].timing;
+    }
+
+    // Play the cards that are ready, keeping the others in order.
+    for (i=0,n=0;i<b->numHand[l];i++) {
+	if (b->timing[i][l] <= 0) {
+	    LanePlayCard(b, l, b->hand[i][l]);
+	} else {
+	    b->hand[n][l]   = b->hand[i][l];
+	    b->timing[n][l] = b->timing[i][l];
+	    n++;
+	}
+    }
+    b->numHand[l] = n;
+}
+
+/**
+ * Simulates the attack of the leftmost card in one lane (see
+ * SimPlayerAttack).
+ *
+ * @param	b		The lane batch.
+ * @param	l		The lane.
+ */
+static void LaneAttack(LaneBatch *b, int l)
+{
+    const LaneCard *t   = &b->types[b->field[0][l]];
+    int             dmg = b->atk[0][l];
+    int             i   = 0;
+
+    if (t->concentrate >= 0) {
+	if (avgConcentrate)
+	    dmg += (b->baseAtk[0][l] * t->concentrate) / 200;
+	else if (LaneChance(b, l, ROLL_CONCENTRATE, 50))
+	    dmg += (b->baseAtk[0][l] * t->concentrate) / 100;
+    }
+    dmg = MAX(dmg - b->demonParry, 0);
+    b->dmgDone[l] += dmg;
+    if (dmg <= 0)
+	return;
+    if (t->bloodsucker > 0) {
+	int increase = MIN((dmg * t->bloodsucker) / 100,
+		b->maxHp[0][l] - b->cardHp[0][l]);
+
+	if (increase > 0)
+	    b->cardHp[0][l] += increase;
+    }
+    for (i=0;i<demonProfile.numCountered;i++) {
+	if (b->numField[l] <= i)
+	    break;
+	if (b->cardHp[i][l] <= 0)
+	    continue;
+	b->cardHp[i][l] -= MIN(demonProfile.counterLevel, b->cardHp[i][l]);
+	if (b->cardHp[i][l] <= 0)
+	    LaneKill(b, l, i);
+    }
+}
+
+/**
+ * Heals every card on the field of the given lanes, like SimRegenerate.
+ *
+ * @param	b		The lane batch.
+ * @param	heal		The amount to heal in each lane (0 for none).
+ * @param	numSlots	The largest field of any lane.
+ */
+static void LaneRegenerate(LaneBatch *b, const int *heal, int numSlots)
+{
+    int s = 0;
+    int l = 0;
+
+    for (s=0;s<numSlots;s++) {
+	for (l=0;l<NUM_LANES;l++) {
+	    int hp     = b->cardHp[s][l];
+	    int amount = MIN(heal[l], b->maxHp[s][l] - hp);
+
+	    if (s < b->numField[l] && hp > 0 && !b->immune[s][l] && amount > 0)
+		b->cardHp[s][l] = hp + amount;
+	}
+    }
+}
+
+/**
+ * Does the fire god and toxic clouds damage to one field slot at the end of
+ * its card's turn (see SimPlayerCard).  The toxic clouds status goes away.
+ *
+ * @param	b		The lane batch.
+ * @param	live		The lanes where the card is alive.
+ * @param	s		The field slot.
+ */
+static void LaneStatusDamage(LaneBatch *b, const bool *live, int s)
+{
+    bool dead[NUM_LANES];
+    int  l = 0;
+
+    for (l=0;l<NUM_LANES;l++) {
+	int fireGod = b->fireGod[s][l];
+	int toxic   = b->toxic[s][l];
+
+	dead[l] = false;
+	if (live[l] && (fireGod >= 0 || toxic >= 0)) {
+	    b->cardHp[s][l] = MAX(b->cardHp[s][l] - MAX(fireGod, 0) -
+		    MAX(toxic, 0), 0);
+	    b->toxic[s][l]  = -1;
+	    dead[l]         = (b->cardHp[s][l] == 0);
+	}
+    }
+    for (l=0;l<NUM_LANES;l++) {
+	if (dead[l])
+	    LaneKill(b, l, s);
+    }
+}
+
+/**
+ * Simulates the player's round in all lanes (see SimRound).  The cards take
+ * their turns left to right, and each turn is done in all lanes at once.
+ *
+ * @param	b		The lane batch.
+ * @param	round		The round.
+ */
+static void LanePlayerRound(LaneBatch *b, int round)
+{
+    bool live[NUM_LANES];
+    int  heal[NUM_LANES];
+    int  numSlots = 0;
+    int  s        = 0;
+    int  l        = 0;
+
+    for (l=0;l<NUM_LANES;l++) {
+	if (b->done[l])
+	    continue;
+	LanePlayCards(b, l);
+	numSlots = MAX(numSlots, b->numField[l]);
+    }
+
+    for (s=0;s<numSlots;s++) {
+	bool regenerate = false;
+
+	for (l=0;l<NUM_LANES;l++) {
+	    live[l] = (!b->done[l] && s < b->numField[l] &&
+		    b->cardHp[s][l] > 0);
+	    heal[l] = (live[l] ? b->types[b->field[s][l]].regenerate : 0);
+	    if (heal[l] > 0)
+		regenerate = true;
+	}
+	if (regenerate)
+	    LaneRegenerate(b, heal, numSlots);
+
+	// Only the leftmost card attacks.
+	if (s == 0 && round >= FIRST_PLAYER_ROUND) {
+	    for (l=0;l<NUM_LANES;l++) {
+		if (live[l]) {
+		    LaneAttack(b, l);
+		    live[l] = (b->cardHp[0][l] > 0);
+		}
+	    }
+	}
+	LaneStatusDamage(b, live, s);
+    }
+
+    for (l=0;l<NUM_LANES;l++) {
+	if (!b->done[l])
+	    LaneRemoveDead(b, l);
+    }
+}
+
+/**
+ * Casts fire god on the field of the given lanes, like SimDemonFireGod.
+ *
+ * @param	b		The lane batch.
+ * @param	live		The lanes where the demon casts it.
+ * @param	level		Damage per round to each card.
+ */
+static void LaneFireGod(LaneBatch *b, const bool *live, int level)
+{
+    int s = 0;
+    int l = 0;
+
+    for (s=0;s<MAX_CARDS_IN_SET;s++) {
+	for (l=0;l<NUM_LANES;l++) {
+	    if (live[l] && s < b->numField[l] && b->cardHp[s][l] > 0 &&
+		    !b->immune[s][l] && b->fireGod[s][l] < 0)
+		b->fireGod[s][l] = level;
+	}
+    }
+}
+
+/**
+ * Casts toxic clouds on the field of the given lanes, like
+ * SimDemonToxicClouds.  A card with immunity stops the clouds from reaching
+ * the cards to its right.
+ *
+ * @param	b		The lane batch.
+ * @param	live		The lanes where the demon casts it.
+ * @param	level		Damage to each card now and next round.
+ */
+static void LaneToxicClouds(LaneBatch *b, const bool *live, int level)
+{
+    bool go[NUM_LANES];
+    bool dead[NUM_LANES];
+    int  s = 0;
+    int  l = 0;
+
+    for (l=0;l<NUM_LANES;l++)
+	go[l] = live[l];
+    for (s=0;s<MAX_CARDS_IN_SET;s++) {
+	for (l=0;l<NUM_LANES;l++) {
+	    int hp = b->cardHp[s][l];
+
+	    dead[l] = false;
+	    if (!go[l] || s >= b->numField[l] || hp <= 0)
+		continue;
+	    if (b->immune[s][l]) {
+		go[l] = false;
+		continue;
+	    }
+	    hp -= MIN(level, hp);
+	    b->cardHp[s][l] = hp;
+	    if (hp <= 0)
+		dead[l] = true;
+	    else if (b->toxic[s][l] < 0)
+		b->toxic[s][l] = level;
+	}
+	for (l=0;l<NUM_LANES;l++) {
+	    if (dead[l])
+		LaneKill(b, l, s);
+	}
+    }
+}
+
+/**
+ * Simulates the demon's attack in one lane (see SimDemonAttack and
+ * DamageCard).
+ *
+ * @param	b		The lane batch.
+ * @param	l		The lane.
+ */
+static void LaneDemonAttack(LaneBatch *b, int l)
+{
+    const DemonProfile *p   = &demonProfile;
+    const LaneCard     *t   = NULL;
+    int                 atk = b->demonAtk;
+
+    if (p->hotChase && p->hotChaseLevel * b->numGrave[l] > 0)
+	atk += p->hotChaseLevel * b->numGrave[l];
+    if (b->numField[l] == 0 || b->field[0][l] < 0) {
+	b->hp[l] -= atk;
+	return;
+    }
+
+    t = &b->types[b->field[0][l]];
+    if (t->dodge >= 0 && LaneChance(b, l, ROLL_DODGE, t->dodge))
+	return;
+    if (t->parry > 0)
+	atk = MAX(atk - t->parry, 0);
+    if (atk <= 0)
+	return;
+    b->cardHp[0][l]   = MAX(b->cardHp[0][l] - atk, 0);
+    b->atk[0][l]     += t->craze;
+    b->baseAtk[0][l] += t->craze;
+    b->dmgDone[l]    += t->hitDmg;
+    if (b->cardHp[0][l] == 0)
+	LaneKill(b, l, 0);
+}
+
+/**
+ * Simulates the demon's round in all lanes (see SimDemon).  Each of the
+ * demon's abilities is done in all lanes at once.
+ *
+ * @param	b		The lane batch.
+ * @param	round		The round.
+ */
+static void LaneDemonRound(LaneBatch *b, int round)
+{
+    const DemonProfile *p = &demonProfile;
+    bool                live[NUM_LANES];
+    int                 i = 0;
+    int                 l = 0;
+
+    if (round < FIRST_DEMON_ROUND)
+	return;
+    if (round >= FIRST_UNAVOIDABLE_ROUND) {
+	int dmg = UnavoidableDamage(round);
+
+	for (l=0;l<NUM_LANES;l++) {
+	    if (!b->done[l])
+		b->hp[l] -= MIN(dmg, b->hp[l]);
+	}
+    }
+
+    for (i=0;i<p->numSteps;i++) {
+	DemonAbility func  = p->steps[i].func;
+	int          level = p->steps[i].level;
+
+	for (l=0;l<NUM_LANES;l++)
+	    live[l] = (!b->done[l] && b->hp[l] > 0);
+	if (func == SimDemonCurse) {
+	    for (l=0;l<NUM_LANES;l++) {
+		if (live[l])
+		    b->hp[l] -= level;
+	    }
+	} else if (func == SimDemonDamnation) {
+	    for (l=0;l<NUM_LANES;l++) {
+		int dmg = level * b->numField[l];
+
+		if (live[l] && dmg > 0)
+		    b->hp[l] -= dmg;
+	    }
+	} else if (func == SimDemonFireGod) {
+	    LaneFireGod(b, live, level);
+	} else {
+	    LaneToxicClouds(b, live, level);
+	}
+    }
+
+    for (l=0;l<NUM_LANES;l++) {
+	if (b->done[l])
+	    continue;
+	if (b->hp[l] > 0)
+	    LaneDemonAttack(b, l);
+	LaneRemoveDead(b, l);
+    }
+}
+
+/**
+ * Runs the fights of all the lanes to the end.
+ *
+ * @param	b		The lane batch, with each lane set up by
+ *				LaneStart (and done set for unused lanes).
+ * @param	localRoundX	The -printround round.
+ */
+static void LaneSimulate(LaneBatch *b, int localRoundX)
+{
+    int round = b->startRound;
+    int h     = 0;
+    int l     = 0;
+
+    for (;;) {
+	int numActive = 0;
+
+	for (l=0;l<NUM_LANES;l++) {
+	    if (b->done[l])
+		continue;
+	    if (!(b->hp[l] > 0 && (b->numField[l] > 0 || b->numDeck[l] > 0 ||
+		    b->numHand[l] > 0) && round <= maxRounds)) {
+		b->done[l]     = true;
+		b->endRound[l] = round - 1;
+		continue;
+	    }
+	    if (round == localRoundX)
+		b->hitRoundX[l] = true;
+	    numActive++;
+	}
+	if (numActive == 0)
+	    break;
+
+	// Timers go down in every lane at once.  Timers of empty hand slots
+	// and of finished lanes aren't used.
+	for (h=0;h<MAX_CARDS_IN_HAND;h++) {
+	    for (l=0;l<NUM_LANES;l++)
+		b->timing[h][l] -= (b->timing[h][l] > 0);
+	}
+
+	if ((round & 1) == 0)
+	    LanePlayerRound(b, round);
+	else
+	    LaneDemonRound(b, round);
+	round++;
+    }
+}
+
+/**
+ * Copies the results of a lane's fight to a state, so that they can be
+ * added up the same way as the results of Simulate.
+ *
+ * @param	b		The lane batch.
+ * @param	l		The lane.
+ * @param	state		Gets dmgDone, round, numRolls, rollExcess and
+ *				weight.
+ */
+static void LaneResult(const LaneBatch *b, int l, State *state)
+{
+    int k = 0;
+
+    state->dmgDone  = b->dmgDone[l];
+    state->round    = b->endRound[l];
+    state->numRolls = b->numRolls[l];
+    state->weight   = b->weight[l];
+    for (k=0;k<NUM_ROLL_TYPES;k++)
+	state->rollExcess[k] = b->rollExcess[k][l];
+}
+
+// Per thread context of the -fork engine.  Each depth of the fight tree is
+// one round, and nodes[depth] holds the state at the start of that round.
+typedef struct forkCtx {
+    State	       *nodes;			// MAX_FORK_DEPTH+1 states.
+    ForkPath		paths[MAX_FORK_DEPTH];	// Replay of each depth.
+    int			roundsLeft;		// Round budget of this fight.
+    unsigned int	numReseeds;		// Sampled subtrees so far.
+    bool		sampled;		// Part of the tree was sampled.
+    long long		rounds;			// Rounds simulated.
+    long long		leaves;			// Outcomes explored.
+    double		dmg;			// Expected dmg of the fight.
+    double		numRounds;		// Expected number of rounds.
+    double		roundX;			// Chance of reaching round X.
+    int			lowDamage;
+    int			highDamage;
+    int			lowRounds;
+    int			highRounds;
+} ForkCtx;
+
+/**
+ * Gives a state new rng seeds before part of a fight tree is sampled, so
+ * that sibling subtrees don't all get the same random numbers.
+ *
+ * @param	ctx		The fork context.
+ * @param	state		The state to reseed.
+ */
+static void ForkReseed(ForkCtx *ctx, State *state)
+{
+    int i = 0;
+
+    ctx->numReseeds++;
+    for (i=0;i<NUM_STREAMS;i++) {
+	unsigned int *w = &state->seedW[i];
+	unsigned int *z = &state->seedZ[i];
+
+	*w = MixBits(*w ^ MixBits(2 * ctx->numReseeds + 1));
+	*z = MixBits(*z ^ MixBits(2 * ctx->numReseeds + 2));
+	if (*w == 0)
+	    *w = 1;
+	if (*z == 0)
+	    *z = 1;
+    }
+}
+
+/**
+ * Adds one finished fight outcome to the totals of the current fight.
+ *
+ * @param	ctx		The fork context.
+ * @param	state		The state at the end of the fight.
+ * @param	weight		The probability of this outcome.
+ * @param	hitRoundX	True if this outcome reached round X.
+ */
+static void ForkLeaf(ForkCtx *ctx, const State *state, double weight,
+	bool hitRoundX)
+{
+    ctx->leaves++;
+    ctx->dmg       += weight * state->dmgDone;
+    ctx->numRounds += weight * state->round;
+    if (hitRoundX)
+	ctx->roundX += weight;
+    ctx->highDamage = MAX(ctx->highDamage, state->dmgDone);
+    ctx->lowDamage  = MIN(ctx->lowDamage,  state->dmgDone);
+    ctx->highRounds = MAX(ctx->highRounds, state->round);
+    ctx->lowRounds  = MIN(ctx->lowRounds,  state->round);
+}
+
+/**
+ * Simulates the round at the given depth into nodes[depth+1], using the
+ * draws scripted in paths[depth].
+ *
+ * @param	ctx		The fork context.
+ * @param	depth		The depth of the round.
+ * @param	prob		Gets the probability of the outcome.
+ * @return			False if the round made too many random
+ *				decisions to be replayed.
+ */
+static bool ForkReplay(ForkCtx *ctx, int depth, double *prob)
+{
+    State    *child = &ctx->nodes[depth+1];
+    ForkPath *path  = &ctx->paths[depth];
+    int       k     = 0;
+
+    memcpy(child, &ctx->nodes[depth], sizeof(State));
+    path->numDraws = 0;
+    path->overflow = false;
+    child->fork    = path;
+    SimRound(child);
+    child->fork    = NULL;
+    ctx->rounds++;
+    ctx->roundsLeft--;
+
+    *prob = 1.0;
+    for (k=0;k<path->numDraws;k++)
+	*prob *= path->prob[k];
+    return !path->overflow;
+}
+
+/**
+ * Moves a ForkPath on to the next combination of outcomes, like counting.
+ * The last decision that still has outcomes left goes to its next outcome,
+ * and the decisions after it will start from their first outcome again.
+ *
+ * @param	path		The path of the last replay.
+ * @return			False if all combinations have been done.
+ */
+static bool NextForkPath(ForkPath *path)
+{
+    int k = 0;
+
+    for (k=path->numDraws-1;k>=0;k--) {
+	if (path->choice[k] + 1 < path->range[k]) {
+	    path->choice[k]++;
+	    path->numScripted = k + 1;
+	    return true;
+	}
+    }
+    return false;
+}
+
+/**
+ * Explores the fight tree from the state at the given depth, adding each
+ * outcome to the totals with its probability.
+ *
+ * The round at this depth is first replayed once for each combination of
+ * outcomes of its random decisions, only to count them.  If there is just
+ * one, its result is used as is.  If there are too many, one of them is
+ * picked at random.  Otherwise each of them is replayed again and explored.
+ * When the round budget runs out, the rest of the fight is sampled the
+ * normal way.  Sampling a subtree instead of exploring it leaves the
+ * expected totals unchanged, only less accurate.
+ *
+ * @param	ctx		The fork context.
+ * @param	depth		The depth to explore from.
+ * @param	weight		The probability of reaching this state.
+ * @param	hitRoundX	True if round X has already been reached.
+ */
+static void ForkNode(ForkCtx *ctx, int depth, double weight, bool hitRoundX)
+{
+    State    *node     = &ctx->nodes[depth];
+    ForkPath *path     = &ctx->paths[depth];
+    int       outcomes = 0;
+    int       start    = node->round;
+    double    prob     = 0;
+
+    if (FightOver(node)) {
+	node->round--;
+	ForkLeaf(ctx, node, weight, hitRoundX);
+	return;
+    }
+
+    if (depth + 1 >= MAX_FORK_DEPTH || ctx->roundsLeft <= 0) {
+	ForkReseed(ctx, node);
+	Simulate(node, roundX, &hitRoundX);
+	ctx->rounds += node->round - start + 1;
+	ctx->sampled = true;
+	ForkLeaf(ctx, node, weight, hitRoundX);
+	return;
+    }
+
+    if (node->round == roundX)
+	hitRoundX = true;
+
+    path->numScripted = 0;
+    do {
+	if (!ForkReplay(ctx, depth, &prob))
+	    outcomes = MAX_FORK_WIDTH;
+	outcomes++;
+    } while (outcomes <= MAX_FORK_WIDTH && NextForkPath(path));
+
+    if (outcomes == 1) {
+	// No random decisions, nodes[depth+1] is the only outcome.
+	ForkNode(ctx, depth+1, weight, hitRoundX);
+    } else if (outcomes > MAX_FORK_WIDTH) {
+	State *child = &ctx->nodes[depth+1];
+
+	memcpy(child, node, sizeof(State));
+	ForkReseed(ctx, child);
+	SimRound(child);
+	ctx->rounds++;
+	ctx->roundsLeft--;
+	ctx->sampled = true;
+	ForkNode(ctx, depth+1, weight, hitRoundX);
+    } else {
+	path->numScripted = 0;
+	do {
+	    ForkReplay(ctx, depth, &prob);
+	    ForkNode(ctx, depth+1, weight * prob, hitRoundX);
+	} while (NextForkPath(path));
+    }
+}
+
+/**
+ * Explores all the ways a fight can go from its starting state (after the
+ * deck has been shuffled), and fills in the expected results in the context.
+ *
+ * @param	ctx		The fork context.
+ * @param	state		The starting state.
+ */
+static void ForkFight(ForkCtx *ctx, const State *state)
+{
+    memcpy(&ctx->nodes[0], state, sizeof(State));
+    ctx->roundsLeft = forkLimit;
+    ctx->numReseeds = 0;
+    ctx->sampled    = false;
+    ctx->rounds     = 0;
+    ctx->leaves     = 0;
+    ctx->dmg        = 0;
+    ctx->numRounds  = 0;
+    ctx->roundX     = 0;
+    ctx->lowDamage  = 0x7fffffff;
+    ctx->highDamage = 0;
+    ctx->lowRounds  = 0x7fffffff;
+    ctx->highRounds = 0;
+    ForkNode(ctx, 0, 1.0, false);
+}
+
+// Expected results from a state at the start of a round to the end of the
+// fight (see SolveNode).
+typedef struct solveValue {
+    double	dmg;			// Expected dmg still to be done.
+    double	rounds;			// Expected number of rounds.
+    double	roundX;			// Chance of reaching round X.
+    int		lowDamage;		// Least dmg still to be done.
+    int		highDamage;		// Most dmg still to be done.
+    int		lowRounds;
+    int		highRounds;
+} SolveValue;
+
+// One solved state in the hash table of the solver.
+typedef struct solveEntry {
+    unsigned long long	hash;
+    PackedState	       *key;		// Packed state, NULL if unused.
+    SolveValue		value;
+} SolveEntry;
+
+// The context of the exact solver.  Like the -fork engine, each depth is
+// one round, and nodes[depth] holds the state at the start of that round.
+typedef struct solveCtx {
+    State	       *nodes;		// maxDepth+1 states.
+    ForkPath	       *paths;		// Replay of each depth.
+    int			maxDepth;
+    SolveEntry	       *table;		// Hash table of solved states.
+    unsigned int	tableSize;	// A power of two.
+    int			numStates;	// Solved states in the table.
+    long long		rounds;		// Rounds simulated.
+    const char	       *failed;		// If not NULL, why the solver gave up.
+} SolveCtx;
+
+/**
+ * Finds the hash table entry for a packed state.
+ *
+ * @param	ctx		The solver context.
+ * @param	key		The packed state.
+ * @param	hash		The hash of the key.
+ * @return			The entry for the key, which is unused (its
+ *				key is NULL) if the state isn't solved yet.
+ */
+static SolveEntry *FindSolved(SolveCtx *ctx, const PackedState *key,
+	unsigned long long hash)
+{
+    unsigned int mask = ctx->tableSize - 1;
+    unsigned int i    = (unsigned int) hash & mask;
+
+    while (ctx->table[i].key != NULL) {
+	SolveEntry *e = &ctx->table[i];
+
+	if (e->hash == hash && !memcmp(e->key, key, sizeof(*key)))
+	    return e;
+	i = (i + 1) & mask;
+    }
+    return &ctx->table[i];
+}
+
+/**
+ * Finds the expected results from the state at the given depth to the end
+ * of the fight.  Each combination of outcomes of the round's random
+ * decisions is replayed (like in ForkNode), and the results of the states
+ * they lead to are averaged using their probabilities.  Since many
+ * different paths lead to the same state, the results of each state are
+ * kept in a hash table so that each state is only solved once.
+ *
+ * @param	ctx		The solver context.
+ * @param	depth		The depth of the state.
+ * @return			The expected results.  If ctx->failed gets
+ *				set, the results are meaningless.
+ */
+static SolveValue SolveNode(SolveCtx *ctx, int depth)
+{
+    State             *node   = &ctx->nodes[depth];
+    State             *child  = &ctx->nodes[depth+1];
+    ForkPath          *path   = &ctx->paths[depth];
+    SolveEntry        *entry  = NULL;
+    PackedState       *key    = NULL;
+    unsigned long long hash   = 0;
+    int                k      = 0;
+    PackedState        ps;
+    SolveValue         v;
+
+    memset(&v, 0, sizeof(v));
+    if (FightOver(node)) {
+	v.rounds     = node->round - 1;
+	v.lowRounds  = node->round - 1;
+	v.highRounds = node->round - 1;
+	return v;
+    }
+    if (ctx->failed != NULL)
+	return v;
+    if (depth + 1 >= ctx->maxDepth) {
+	ctx->failed = "the fight is too long";
+	return v;
+    }
+
+    if (!PackState(node, &ps)) {
+	ctx->failed = "a state is too big to pack";
+	return v;
+    }
+    hash  = HashPacked(&ps);
+    entry = FindSolved(ctx, &ps, hash);
+    if (entry->key != NULL)
+	return entry->value;
+    if (ctx->numStates >= solveLimit) {
+	ctx->failed = "there are too many states";
+	return v;
+    }
+    key  = (PackedState *) malloc(sizeof(PackedState));
+    *key = ps;
+
+    v.lowDamage = 0x7fffffff;
+    v.lowRounds = 0x7fffffff;
+    path->numScripted = 0;
+    do {
+	SolveValue cv;
+	double     prob = 1.0;
+	int        gain = 0;
+
+	memcpy(child, node, sizeof(State));
+	path->numDraws = 0;
+	path->overflow = false;
+	child->fork    = path;
+	SimRound(child);
+	child->fork    = NULL;
+	ctx->rounds++;
+	if (path->overflow) {
+	    ctx->failed = "a round has too many random events";
+	    break;
+	}
+	for (k=0;k<path->numDraws;k++)
+	    prob *= path->prob[k];
+	gain = child->dmgDone - node->dmgDone;
+
+	cv = SolveNode(ctx, depth+1);
+	if (ctx->failed != NULL)
+	    break;
+	v.dmg       += prob * (gain + cv.dmg);
+	v.rounds    += prob * cv.rounds;
+	v.roundX    += prob * cv.roundX;
+	v.lowDamage  = MIN(v.lowDamage,  gain + cv.lowDamage);
+	v.highDamage = MAX(v.highDamage, gain + cv.highDamage);
+	v.lowRounds  = MIN(v.lowRounds,  cv.lowRounds);
+	v.highRounds = MAX(v.highRounds, cv.highRounds);
+    } while (NextForkPath(path));
+    if (ctx->failed != NULL) {
+	free(key);
+	return v;
+    }
+    if (node->round == roundX)
+	v.roundX = 1.0;
+
+    // The table has changed while solving the later states.
+    entry = FindSolved(ctx, key, hash);
+    entry->hash  = hash;
+    entry->key   = key;
+    entry->value = v;
+    ctx->numStates++;
+    return v;
+}
+
+/**
+ * Calculates the cost of the deck.  This affects the deck's cooldown.  The
+ * cards of every set are counted, since a snapshot (see -snapshot) may
+ * start with cards outside of the deck.
+ *
+ * @param	state	The state holding the deck (normally the default state).
+ * @return		Deck cost.
+ */
+int CalcCost(const State *state)
+{
+    const CardSet *sets[4];
+    int            i    = 0;
+    int            j    = 0;
+    int            cost = 0;
+
+    sets[0] = &state->deck;
+    sets[1] = &state->hand;
+    sets[2] = &state->field;
+    sets[3] = &state->grave;
+    for (i=0;i<4;i++) {
+	for (j=0;j<sets[i]->numCards;j++)
+	    cost += sets[i]->cards[j].cost;
+    }
+    return cost;
+}
+
+/**
+ * Takes a string and strips spaces from the front and end of the string.
+ * This is normally the strtrim() function but not every platform has it
+ * so I had to write my own.
+ */
+static char *trim(char *s)
+{
+    int len = 0;
+
+    while (isspace((unsigned int) (*s)))
+	s++;
+    len = strlen(s);
+    while (len > 0 && isspace((unsigned int)(s[len-1])))
+	len--;
+    s[len] = '\0';
+    return s;
+}
+
+/**
+ * Returns an allocated copy of a string.  This is normally the strdup()
+ * function but not every platform has it so I had to write my own.
+ */
+static char *my_strdup(const char *s)
+{
+    int   len = strlen(s);
+    char *ret = (char *) malloc(len+1);
+
+    strcpy(ret, s);
+    return ret;
+}
+
+/**
+ * Reads the cards.txt file to get all the card descriptions from that
+ * file.  Fills in the cardTypes array.
+ *
+ * @param	filename	The name of the cards file (normally cards.txt).
+ */
+static void readCardTypesFromFile(const char *filename)
+{
+    static char buffer[MAX_LINE_SIZE];
+    FILE *f       = NULL;
+    char *trimmed = NULL;
+    char *s       = NULL;
+    bool  error   = false;
+    int   attr    = 0;
+    Card *c       = NULL;
+
+    f = fopen(filename, "r");
+    if (f == NULL) {
+	fprintf(stderr, "Error: Couldn't read file %s.\n", filename);
+	exit(1);
+    }
+    numCardTypes = 0;
+    ResetNameIndex();
+    while (fgets(buffer, MAX_LINE_SIZE, f) != NULL) {
+	buffer[MAX_LINE_SIZE-1] = '\0';
+	trimmed = trim(buffer);
+	if (trimmed[0] == '#' || trimmed[0] == '\0')
+	    continue;
+
+	c = &cardTypes[numCardTypes];
+
+	// Name
+	s = strtok(trimmed, ",");
+	if (s == NULL) {
+	    fprintf(stderr, "Bad card description: %s\n", trimmed);
+	    exit(1);
+	}
+	c->name = my_strdup(trim(s));
+	c->id   = numCardTypes;
+
+	// Cost
+	s = strtok(NULL, ",");
+	if (s == NULL) { error = true; break; }
+	c->cost = strtoul(trim(s), NULL, 0);
+	if (c->cost == 0) {
+	    fprintf(stderr, "Bad cost: %s\n", trim(s));
+	    error = true;
+	    break;
+	}
+
+	// Timing
+	s = strtok(NULL, ",");
+	if (s == NULL) { error = true; break; }
+	c->timing = strtoul(trim(s), NULL, 0);
+	if (c->timing == 0) {
+	    fprintf(stderr, "Bad timing: %s\n", trim(s));
+	    error = true;
+	    break;
+	}
+
+	// Base atk
+	s = strtok(NULL, ",");
+	if (s == NULL) { error = true; break; }
+	c->baseAtk = strtoul(trim(s), NULL, 0);
+	if (c->baseAtk == 0) {
+	    fprintf(stderr, "Bad attack: %s\n", trim(s));
+	    error = true;
+	    break;
+	}
+
+	// Base hp
+	s = strtok(NULL, ",");
+	if (s == NULL) { error = true; break; }
+	c->baseHp = strtoul(trim(s), NULL, 0);
+	if (c->baseHp == 0) {
+	    fprintf(stderr, "Bad hp: %s\n", trim(s));
+	    error = true;
+	    break;
+	}
+
+	// Attributes
+	attr = 0;
+	do {
+	    int   attrType = 0;
+	    char *colon    = NULL;
+	    int   value    = 0;
+
+	    s = strtok(NULL, ",");
+	    if (s == NULL)
+		break;
+	    s = trim(s);
+	    colon = strchr(s, ':');
+	    if (colon) {
+		*colon = '\0';
+		value = strtoul(colon+1, NULL, 0);
+	    }
+	    attrType = LookupAttr(s);
+	    if (attrType == -1) {
+		fprintf(stderr, "Bad attribute: %s not found\n", s);
+		PrintSuggestion(NAME_ATTR, s);
+		error = true;
+		break;
+	    }
+	    if (value < 0 || value > MAX_ATTR_LEVEL) {
+		fprintf(stderr, "Bad attribute: %s:%s is over %d\n", s,
+			colon+1, MAX_ATTR_LEVEL);
+		error = true;
+		break;
+	    }
+	    c->baseAttr[attr].type  = attrType;
+	    c->baseAttr[attr].level = value;
+	    attr++;
+	} while (attr < MAX_ATTR-1);
+	if (error)
+	    break;
+	cardTypes[numCardTypes].baseAttr[attr].type = ATTR_NONE;
+	cardTypes[numCardTypes].numBaseAttr         = attr;
+	AddName(NAME_CARD, c->name, numCardTypes);
+	numCardTypes++;
+    }
+    if (error) {
+	fprintf(stderr, "Bad card description: %s\n",
+		cardTypes[numCardTypes].name);
+	exit(1);
+    }
+    fclose(f);
+}
+
+/**
+ * Reads the deck description from a file.  Fills in theDeck array and
+ * theRunes array.
+ *
+ * @param	filename	Filename of deck file.
+ */
+static void readDeckFromFile(const char *filename)
+{
+    static char buffer[MAX_LINE_SIZE];
+    FILE *f       = NULL;
+    char *trimmed = NULL;
+
+    f = fopen(filename, "r");
+    if (f == NULL) {
+	fprintf(stderr, "Error: Couldn't read file %s.\n", filename);
+	exit(1);
+    }
+    numDeckCards = 0;
+    numRunes = 0;
+    while (fgets(buffer, MAX_LINE_SIZE, f) != NULL) {
+	buffer[MAX_LINE_SIZE-1] = '\0';
+	trimmed = trim(buffer);
+	if (trimmed[0] == '#' || trimmed[0] == '\0')
+	    continue;
+	if (FindCard(trimmed) != NULL) {
+	    // Found a card.
+	    if (numDeckCards >= MAX_CARDS_IN_DECK) {
+		fprintf(stderr, "Error: Too many cards in deck.\n");
+		exit(1);
+	    }
+	    theDeck[numDeckCards++] = my_strdup(trimmed);
+	} else if (FindRune(trimmed) != NULL) {
+	    // Found a rune.
+	    if (numRunes >= MAX_RUNES) {
+		fprintf(stderr, "Error: Too many runes.\n");
+		exit(1);
+	    }
+	    theRunes[numRunes++] = my_strdup(trimmed);
+	} else {
+	    fprintf(stderr, "Error: Unknown card/rune %s.\n", trimmed);
+	    PrintSuggestion(NAME_CARD | NAME_RUNE, trimmed);
+	    exit(1);
+	}
+    }
+    fclose(f);
+}
+
+/**
+ * Reads the list of candidate cards and runes for the sensitivity analysis.
+ * The file has the same format as a deck file, except that there is no limit
+ * on the number of cards or runes.
+ *
+ * @param	filename	Filename of candidates file.
+ */
+static void readCandidatesFromFile(const char *filename)
+{
+    static char buffer[MAX_LINE_SIZE];
+    FILE *f       = NULL;
+    char *trimmed = NULL;
+
+    f = fopen(filename, "r");
+    if (f == NULL) {
+	fprintf(stderr, "Error: Couldn't read file %s.\n", filename);
+	exit(1);
+    }
+    numCandidates = 0;
+    while (fgets(buffer, MAX_LINE_SIZE, f) != NULL) {
+	buffer[MAX_LINE_SIZE-1] = '\0';
+	trimmed = trim(buffer);
+	if (trimmed[0] == '#' || trimmed[0] == '\0')
+	    continue;
+	if (FindCard(trimmed) == NULL && FindRune(trimmed) == NULL) {
+	    fprintf(stderr, "Error: Unknown card/rune %s.\n", trimmed);
+	    PrintSuggestion(NAME_CARD | NAME_RUNE, trimmed);
+	    exit(1);
+	}
+	if (numCandidates >= MAX_CANDIDATES) {
+	    fprintf(stderr, "Error: Too many candidates.\n");
+	    exit(1);
+	}
+	theCandidates[numCandidates++] = my_strdup(trimmed);
+    }
+    fclose(f);
+}
+
+/**
+ * Reads the demons and decks for -compare.  Each line has a demon name and
+ * a deck file, separated by a comma.
+ *
+ * @param	filename	The corpus file.
+ */
+static void readCorpusFromFile(const char *filename)
+{
+    static char buffer[MAX_LINE_SIZE];
+    FILE *f       = NULL;
+    char *trimmed = NULL;
+    char *demon   = NULL;
+    char *deck    = NULL;
+
+    f = fopen(filename, "r");
+    if (f == NULL) {
+	fprintf(stderr, "Error: Couldn't read file %s.\n", filename);
+	exit(1);
+    }
+    numCorpus = 0;
+    while (fgets(buffer, MAX_LINE_SIZE, f) != NULL) {
+	buffer[MAX_LINE_SIZE-1] = '\0';
+	trimmed = trim(buffer);
+	if (trimmed[0] == '#' || trimmed[0] == '\0')
+	    continue;
+	demon = strtok(trimmed, ",");
+	deck  = strtok(NULL, ",");
+	if (deck == NULL) {
+	    fprintf(stderr, "Error: Bad line in %s: %s\n", filename, trimmed);
+	    exit(1);
+	}
+	demon = trim(demon);
+	deck  = trim(deck);
+	if (FindCard(demon) == NULL) {
+	    fprintf(stderr, "Error: Unknown demon %s.\n", demon);
+	    PrintSuggestion(NAME_CARD, demon);
+	    exit(1);
+	}
+	if (numCorpus >= MAX_CORPUS) {
+	    fprintf(stderr, "Error: Too many decks in %s.\n", filename);
+	    exit(1);
+	}
+	theCorpusDemons[numCorpus] = my_strdup(demon);
+	theCorpusDecks[numCorpus]  = my_strdup(deck);
+	numCorpus++;
+    }
+    fclose(f);
+}
+
+/**
+ * Returns the name of an attribute, for printing.
+ *
+ * @param	attrType	The attribute type.
+ * @return			The attribute's name.
+ */
+static const char *AttrName(int attrType)
+{
+    int i = 0;
+
+    for (i=0;i<DIM(allAttrs);i++) {
+	if (allAttrs[i].attrType == attrType)
+	    return allAttrs[i].name;
+    }
+    for (i=0;i<DIM(allRunes);i++) {
+	if (allRunes[i].attr.type == attrType)
+	    return allRunes[i].name;
+    }
+    return "UNKNOWN";
+}
+
+/**
+ * Writes one card of a snapshot.  The line has the current timing, atk,
+ * base atk, hp, max hp, and all current attributes of the card.  Attributes
+ * without a name are written as their number.
+ *
+ * @param	f		The snapshot file.
+ * @param	set		The set name (e.g. "hand").
+ * @param	c		The card.
+ */
+static void writeSnapshotCard(FILE *f, const char *set, const Card *c)
+{
+    int i = 0;
+
+    fprintf(f, "%s, %s, %d, %d, %d, %d, %d", set, c->name, c->curTiming,
+	    c->atk, c->curBaseAtk, c->hp, c->maxHp);
+    for (i=0;i<c->numAttr;i++) {
+	const char *name = AttrName(c->attr[i].type);
+
+	if (LookupAttr(name) == c->attr[i].type)
+	    fprintf(f, ", %s:%d", name, c->attr[i].level);
+	else
+	    fprintf(f, ", %d:%d", c->attr[i].type, c->attr[i].level);
+    }
+    fprintf(f, "\n");
+}
+
+/**
+ * Writes a snapshot of a state at the start of a round (see -saveround).
+ *
+ * @param	filename	Filename of the snapshot file.
+ * @param	state		The state.
+ */
+static void writeSnapshotToFile(const char *filename, const State *state)
+{
+    FILE *f = NULL;
+    int   i = 0;
+
+    f = fopen(filename, "w");
+    if (f == NULL) {
+	fprintf(stderr, "Error: Couldn't write file %s.\n", filename);
+	exit(1);
+    }
+    fprintf(f, "# Snapshot at the start of round %d.\n", state->round);
+    fprintf(f, "round, %d\n", state->round);
+    fprintf(f, "player, %d, %d\n", state->hp, state->maxHp);
+    fprintf(f, "dmg, %d\n", state->dmgDone);
+    writeSnapshotCard(f, "demon", &state->demon);
+    for (i=0;i<state->deck.numCards;i++)
+	writeSnapshotCard(f, "deck", &state->deck.cards[i]);
+    for (i=0;i<state->hand.numCards;i++)
+	writeSnapshotCard(f, "hand", &state->hand.cards[i]);
+    for (i=0;i<state->field.numCards;i++)
+	writeSnapshotCard(f, "field", &state->field.cards[i]);
+    for (i=0;i<state->grave.numCards;i++)
+	writeSnapshotCard(f, "grave", &state->grave.cards[i]);
+    for (i=0;i<state->numRunes;i++) {
+	fprintf(f, "rune, %s, %d, %d\n", state->runes[i].name,
+		state->runes[i].chargesUsed, state->runes[i].usedThisRound);
+    }
+    fclose(f);
+}
+
+/**
+ * Reads the next comma separated number of a snapshot line.
+ *
+ * @param	line		The line, for the error message.
+ * @return			The number.
+ */
+static int snapshotNumber(const char *line)
+{
+    char *s   = strtok(NULL, ",");
+    char *end = NULL;
+    long  n   = 0;
+
+    if (s != NULL) {
+	s = trim(s);
+	n = strtol(s, &end, 0);
+    }
+    if (s == NULL || *s == '\0' || *end != '\0') {
+	fprintf(stderr, "Error: Bad snapshot line: %s\n", line);
+	exit(1);
+    }
+    return (int) n;
+}
+
+/**
+ * Reads one card of a snapshot (see writeSnapshotCard).  The card's name
+ * has already been read.
+ *
+ * @param	c		Gets the card.
+ * @param	name		The card's name.
+ * @param	line		The line, for error messages.
+ */
+static void readSnapshotCard(Card *c, const char *name, const char *line)
+{
+    const Card *type = FindCard(name);
+    char       *s    = NULL;
+
+    if (type == NULL) {
+	fprintf(stderr, "Error: Unknown card %s in snapshot.\n", name);
+	PrintSuggestion(NAME_CARD, name);
+	exit(1);
+    }
+    *c = *type;
+    c->curTiming  = snapshotNumber(line);
+    c->atk        = snapshotNumber(line);
+    c->curBaseAtk = snapshotNumber(line);
+    c->hp         = snapshotNumber(line);
+    c->maxHp      = snapshotNumber(line);
+    c->numAttr    = 0;
+    memset(c->attr, 0, sizeof(c->attr));
+    while ((s = strtok(NULL, ",")) != NULL) {
+	char *colon = NULL;
+	int   attr  = 0;
+	long  level = 0;
+
+	s = trim(s);
+	colon = strchr(s, ':');
+	if (colon != NULL)
+	    *colon = '\0';
+	attr = isdigit((unsigned char) s[0]) ? (int) strtoul(s, NULL, 0) :
+		LookupAttr(s);
+	if (colon != NULL)
+	    level = strtol(colon+1, NULL, 0);
+	if (attr <= ATTR_NONE || attr >= NUM_ATTR_TYPES ||
+		c->numAttr >= MAX_ATTR || level < -MAX_ATTR_LEVEL ||
+		level > MAX_ATTR_LEVEL) {
+	    fprintf(stderr, "Error: Bad attribute %s in snapshot.\n", s);
+	    exit(1);
+	}
+	c->attr[c->numAttr].type  = attr;
+	c->attr[c->numAttr].level = level;
+	c->numAttr++;
+    }
+}
+
+/**
+ * Reads a snapshot written by -saveround into a state, so that fights
+ * continue from there instead of from round 1.  The snapshot replaces the
+ * player, the demon, and all the cards of the state.  Runes are replaced
+ * only if the snapshot has rune lines, so leaving them out uses the runes
+ * of the deck file.  The -hp and -demon options, if given, override the
+ * player's hp and the demon of the snapshot.
+ *
+ * @param	state		The state (normally the default state).
+ * @param	filename	Filename of the snapshot file.
+ */
+static void readSnapshotFromFile(State *state, const char *filename)
+{
+    static char buffer[MAX_LINE_SIZE];
+    static char line[MAX_LINE_SIZE];
+    FILE *f        = NULL;
+    char *trimmed  = NULL;
+    char *s        = NULL;
+    int   numRunes = 0;
+    bool  haveRound = false;
+    Card  c;
+
+    f = fopen(filename, "r");
+    if (f == NULL) {
+	fprintf(stderr, "Error: Couldn't read file %s.\n", filename);
+	exit(1);
+    }
+    state->dmgDone        = 0;
+    state->deck.numCards  = 0;
+    state->hand.numCards  = 0;
+    state->field.numCards = 0;
+    state->grave.numCards = 0;
+    while (fgets(buffer, MAX_LINE_SIZE, f) != NULL) {
+	buffer[MAX_LINE_SIZE-1] = '\0';
+	trimmed = trim(buffer);
+	if (trimmed[0] == '#' || trimmed[0] == '\0')
+	    continue;
+	strcpy(line, trimmed);
+	s = trim(strtok(trimmed, ","));
+
+	if (!strcasecmp(s, "round")) {
+	    state->round = snapshotNumber(line);
+	    haveRound    = true;
+	} else if (!strcasecmp(s, "player")) {
+	    state->hp    = snapshotNumber(line);
+	    state->maxHp = snapshotNumber(line);
+	} else if (!strcasecmp(s, "dmg")) {
+	    state->dmgDone = snapshotNumber(line);
+	} else if (!strcasecmp(s, "rune")) {
+	    const Rune *rune = NULL;
+
+	    s = strtok(NULL, ",");
+	    rune = (s != NULL) ? FindRune(trim(s)) : NULL;
+	    if (rune == NULL || numRunes >= MAX_RUNES) {
+		fprintf(stderr, "Error: Bad snapshot line: %s\n", line);
+		exit(1);
+	    }
+	    state->runes[numRunes] = *rune;
+	    state->runes[numRunes].chargesUsed   = snapshotNumber(line);
+	    state->runes[numRunes].usedThisRound = snapshotNumber(line);
+	    state->numRunes = ++numRunes;
+	} else if (!strcasecmp(s, "demon") || !strcasecmp(s, "deck") ||
+		   !strcasecmp(s, "hand")  || !strcasecmp(s, "field") ||
+		   !strcasecmp(s, "grave")) {
+	    char *name = strtok(NULL, ",");
+
+	    if (name == NULL) {
+		fprintf(stderr, "Error: Bad snapshot line: %s\n", line);
+		exit(1);
+	    }
+	    readSnapshotCard(&c, trim(name), line);
+	    if (!strcasecmp(s, "demon"))
+		state->demon = c;
+	    else if (!strcasecmp(s, "deck"))
+		AddCardToSet(&state->deck, &c);
+	    else if (!strcasecmp(s, "hand"))
+		AddCardToSet(&state->hand, &c);
+	    else if (!strcasecmp(s, "field"))
+		AddCardToSet(&state->field, &c);
+	    else
+		AddCardToSet(&state->grave, &c);
+	} else {
+	    fprintf(stderr, "Error: Bad snapshot line: %s\n", line);
+	    exit(1);
+	}
+    }
+    fclose(f);
+    if (!haveRound) {
+	fprintf(stderr, "Error: No round in snapshot %s.\n", filename);
+	exit(1);
+    }
+
+    if (haveHp) {
+	state->hp    = initialHp;
+	state->maxHp = MAX(state->maxHp, initialHp);
+    }
+    if (haveDemon) {
+	const Card *demon = FindCard(theDemon);
+
+	if (demon == NULL) {
+	    fprintf(stderr, "Couldn't find demon card: %s\n", theDemon);
+	    PrintSuggestion(NAME_CARD, theDemon);
+	    exit(1);
+	}
+	state->demon = *demon;
+	InitCard(&state->demon);
+    }
+}
+
+/**
+ * Plays the first fight of the run up to the start of round saveRound, and
+ * writes a snapshot of it to saveFile (see -saveround).  With -debug, the
+ * rounds leading up to the snapshot are printed.
+ */
+static void SaveRound(void)
+{
+    State *state = (State *) malloc(sizeof(State));
+
+    InitState(state, &defaultState, 0);
+    ShuffleSet(state, &state->deck);
+    while (state->round < saveRound && !FightOver(state))
+	SimRound(state);
+    if (state->round != saveRound || FightOver(state)) {
+	fprintf(stderr, "Error: The fight ended before round %d.\n",
+		saveRound);
+	exit(1);
+    }
+    writeSnapshotToFile(saveFile, state);
+    fprintf(output, "Saved round %d of the fight (%d hp, %d dmg done) "
+	    "to %s.\n", state->round, state->hp, state->dmgDone, saveFile);
+    free(state);
+}
+
+/**
+ * Handles command line arguments.
+ */
+static void HandleArgs(int argc, char **argv)
+{
+    int i = 0;
+
+    for (i=1;i<argc;i++) {
+	if (!strcasecmp(argv[i], "-level")) {
+	    i++;
+	    if (i < argc) {
+		initialLevel = strtoul(argv[i], NULL, 0);
+		if (initialLevel <= 0 || initialLevel > MAX_LEVEL) {
+		    fprintf(stderr, "Bad level: %d\n", initialLevel);
+		    exit(1);
+		}
+		initialHp = hpPerLevel[initialLevel];
+	    }
+	} else if (!strcasecmp(argv[i], "-hp")) {
+	    i++;
+	    if (i < argc) {
+		initialHp = strtoul(argv[i], NULL, 0);
+		haveHp    = true;
+	    }
+	} else if (!strcasecmp(argv[i], "-iter")) {
 	    i++;
 	    if (i < argc)
-		theDemon = argv[i];
+		numIters = strtoul(argv[i], NULL, 0);
+	} else if (!strcasecmp(argv[i], "-demon")) {
+	    i++;
+	    if (i < argc) {
+		theDemon  = argv[i];
+		haveDemon = true;
+	    }
 	} else if (!strcasecmp(argv[i], "-debug")) {
 	    doDebug = true;
 	    numIters = 10;
@@ -3280,6 +6085,152 @@ static void HandleArgs(int argc, char **argv)
 	    numIters = 200;
 	} else if (!strcasecmp(argv[i], "-avgconcentrate")) {
 	    avgConcentrate = true;
+	} else if (!strcasecmp(argv[i], "-seed")) {
+	    i++;
+	    if (i < argc) {
+		runSeed  = strtoul(argv[i], NULL, 0);
+		haveSeed = true;
+	    }
+	} else if (!strcasecmp(argv[i], "-exact")) {
+	    doExact = true;
+	} else if (!strcasecmp(argv[i], "-exactlimit")) {
+	    i++;
+	    if (i < argc)
+		exactLimit = strtoul(argv[i], NULL, 0);
+	} else if (!strcasecmp(argv[i], "-stratify")) {
+	    i++;
+	    if (i < argc)
+		stratifyCards = strtoul(argv[i], NULL, 0);
+	} else if (!strcasecmp(argv[i], "-neyman")) {
+	    doNeyman = true;
+	} else if (!strcasecmp(argv[i], "-antithetic")) {
+	    doAntithetic = true;
+	} else if (!strcasecmp(argv[i], "-controlvariates")) {
+	    doControlVariates = true;
+	} else if (!strcasecmp(argv[i], "-tilt")) {
+	    int j = 0;
+
+	    i += 2;
+	    if (i >= argc)
+		break;
+	    for (j=0;j<NUM_ROLL_TYPES;j++) {
+		if (!strcasecmp(argv[i-1], rollNames[j]))
+		    break;
+	    }
+	    if (j == NUM_ROLL_TYPES) {
+		fprintf(stderr, "Error: Unknown roll type for -tilt: %s\n",
+			argv[i-1]);
+		exit(1);
+	    }
+	    tiltPercent[j] = strtol(argv[i], NULL, 0);
+	    doTilt = true;
+	} else if (!strcasecmp(argv[i], "-estimate")) {
+	    i++;
+	    if (i < argc)
+		estimateFile = argv[i];
+	} else if (!strcasecmp(argv[i], "-calibrate")) {
+	    i++;
+	    if (i < argc)
+		calibrateFile = argv[i];
+	} else if (!strcasecmp(argv[i], "-enumerate")) {
+	    i++;
+	    if (i >= argc)
+		break;
+	    enumerateCards = strtol(argv[i], NULL, 0);
+	    if (enumerateCards <= 0 || enumerateCards > MAX_CARDS_IN_DECK) {
+		fprintf(stderr, "Error: Bad number of cards for -enumerate: "
+			"%s\n", argv[i]);
+		exit(1);
+	    }
+	} else if (!strcasecmp(argv[i], "-maxcost")) {
+	    i++;
+	    if (i < argc)
+		maxCost = strtol(argv[i], NULL, 0);
+	} else if (!strcasecmp(argv[i], "-boundslack")) {
+	    i++;
+	    if (i < argc)
+		boundSlack = strtol(argv[i], NULL, 0);
+	} else if (!strcasecmp(argv[i], "-compare")) {
+	    int j = 0;
+
+	    i++;
+	    if (i >= argc)
+		break;
+	    doCompare = true;
+	    // With none, only the seeds differ, which checks the tests.
+	    if (!strcasecmp(argv[i], "none"))
+		continue;
+	    for (j=0;j<NUM_SWITCHES;j++) {
+		if (!strcasecmp(argv[i], switchNames[j]) ||
+			(argv[i][0] == '-' &&
+			 !strcasecmp(&argv[i][1], switchNames[j])))
+		    break;
+	    }
+	    if (j == NUM_SWITCHES) {
+		fprintf(stderr, "Error: Unknown switch for -compare: %s\n",
+			argv[i]);
+		exit(1);
+	    }
+	    compareFlip[j] = true;
+	} else if (!strcasecmp(argv[i], "-corpus")) {
+	    i++;
+	    if (i < argc)
+		corpusFile = argv[i];
+	} else if (!strcasecmp(argv[i], "-window")) {
+	    i++;
+	    if (i >= argc)
+		break;
+	    windowMinutes = strtol(argv[i], NULL, 0);
+	    if (windowMinutes <= 0) {
+		fprintf(stderr, "Error: Bad minutes for -window: %s\n",
+			argv[i]);
+		exit(1);
+	    }
+	} else if (!strcasecmp(argv[i], "-taildmg")) {
+	    i++;
+	    if (i < argc)
+		tailDamage = strtoul(argv[i], NULL, 0);
+	} else if (!strcasecmp(argv[i], "-saveround")) {
+	    i += 2;
+	    if (i >= argc)
+		break;
+	    saveRound = strtoul(argv[i-1], NULL, 0);
+	    saveFile  = argv[i];
+	    if (saveRound <= 0) {
+		fprintf(stderr, "Error: Bad round for -saveround: %s\n",
+			argv[i-1]);
+		exit(1);
+	    }
+	} else if (!strcasecmp(argv[i], "-snapshot")) {
+	    i++;
+	    if (i < argc)
+		snapshotFile = argv[i];
+	} else if (!strcasecmp(argv[i], "-nocycles")) {
+	    noCycles = true;
+	} else if (!strcasecmp(argv[i], "-nolanes")) {
+	    noLanes = true;
+	} else if (!strcasecmp(argv[i], "-fullshuffle")) {
+	    fullShuffle = true;
+	} else if (!strcasecmp(argv[i], "-solve")) {
+	    doSolve = true;
+	} else if (!strcasecmp(argv[i], "-solvelimit")) {
+	    i++;
+	    if (i < argc)
+		solveLimit = strtoul(argv[i], NULL, 0);
+	} else if (!strcasecmp(argv[i], "-fork")) {
+	    doFork = true;
+	} else if (!strcasecmp(argv[i], "-forklimit")) {
+	    i++;
+	    if (i < argc)
+		forkLimit = strtoul(argv[i], NULL, 0);
+	} else if (!strcasecmp(argv[i], "-sensitivity")) {
+	    doSensitivity = true;
+	} else if (!strcasecmp(argv[i], "-compile")) {
+	    doCompile = true;
+	} else if (!strcasecmp(argv[i], "-candidates")) {
+	    i++;
+	    if (i < argc)
+		candidatesFile = argv[i];
 	} else if (!strcasecmp(argv[i], "-numthreads")) {
 	    i++;
 	    if (i < argc)
@@ -3307,144 +6258,2876 @@ static void HandleArgs(int argc, char **argv)
 		outputFilename = argv[i];
 		doAppend = false;
 	    }
-	} else if (!strcasecmp(argv[i], "-a") ||
-		!strcasecmp(argv[i], "-append")) {
-	    i++;
-	    if (i < argc) {
-		outputFilename = argv[i];
-		doAppend = true;
+	} else if (!strcasecmp(argv[i], "-a") ||
+		!strcasecmp(argv[i], "-append")) {
+	    i++;
+	    if (i < argc) {
+		outputFilename = argv[i];
+		doAppend = true;
+	    }
+	}
+    }
+    if (doDebug || showDamage)
+	numThreads = 1;
+}
+
+#define MAX_DEFAULT_ARGS	50
+
+/**
+ * Reads the defaults.txt file and handles command line arguments in that file.
+ */
+static void HandleDefaultArgs(void)
+{
+    static char defaultArgs[MAX_LINE_SIZE];
+    char       *argArray[MAX_DEFAULT_ARGS];
+    FILE       *def     = NULL;
+    int         numArgs = 1;
+    char       *start   = NULL;
+    char       *s       = NULL;
+
+    def = fopen("defaults.txt", "r");
+    if (def == NULL)
+	return;
+    if (fgets(defaultArgs, MAX_LINE_SIZE, def) != NULL) {
+	start = trim(defaultArgs);
+
+	do {
+	    s = strchr(start, ' ');
+	    if (s != NULL) {
+		argArray[numArgs++] = start;
+		*s = '\0';
+		start = trim(s+1);
+	    } else {
+		argArray[numArgs++] = start;
+		break;
+	    }
+	} while(numArgs < MAX_DEFAULT_ARGS);
+
+	if (numArgs > 1)
+	    HandleArgs(numArgs, argArray);
+    }
+    fclose(def);
+}
+
+/**
+ * The entrypoint for one thread.  This will run the specified number of
+ * simulations, and put the results in the given Task structure.
+ *
+ * @param	arg		A Task structure holding the State and the
+ *				number of iterations to run.  The results
+ *				will also be placed in the Task.
+ */
+#if defined(USING_WINDOWS)
+static DWORD WINAPI ThreadSimulate(LPVOID arg)
+#else
+static void *ThreadSimulate(void *arg)
+#endif
+{
+    Task     *task          = (Task *) arg;
+    State    *state         = task->state;
+    int       numIterations = task->numIterations;
+    Result   *result        = task->result;
+    int       i             = 0;
+    long long total         = 0;
+    long long totalRounds   = 0;
+    int       lowRounds     = 0x7fffffff;
+    int       highRounds    = 0;
+    int       lowDamage     = 0x7fffffff;
+    int       highDamage    = 0;
+    int       localRoundX   = roundX;
+    int       timesRoundX   = 0;
+    int       randomFights  = 0;
+    bool      hitRoundX     = false;
+    ForkCtx  *forkCtx       = NULL;
+    LaneBatch *lanes        = NULL;
+
+    if (task->fork) {
+	forkCtx = (ForkCtx *) calloc(1, sizeof(ForkCtx));
+	forkCtx->nodes = (State *) malloc((MAX_FORK_DEPTH + 1) * sizeof(State));
+    } else if (!noLanes && !doDebug && !verbose) {
+	lanes = (LaneBatch *) malloc(sizeof(LaneBatch));
+	if (!LaneDeckFits(lanes, task->initial)) {
+	    free(lanes);
+	    lanes = NULL;
+	}
+    }
+
+    for (i=0;i<numIterations;i++) {
+	int fightNum = task->firstFight + i;
+
+	// Simple decks run NUM_LANES fights at a time in the lane engine.
+	if (lanes != NULL) {
+	    int l = i % NUM_LANES;
+
+	    if (l == 0) {
+		for (l=0;l<NUM_LANES;l++) {
+		    if (i + l < numIterations)
+			LaneStart(lanes, l, task, i + l, state);
+		    else
+			lanes->done[l] = true;
+		}
+		LaneSimulate(lanes, localRoundX);
+		l = 0;
+	    }
+	    LaneResult(lanes, l, state);
+	    hitRoundX = lanes->hitRoundX[l];
+	    goto Tally;
+	}
+
+	// In antithetic mode, fights 2N and 2N+1 use the same seeds, with the
+	// second one using the opposite random numbers.
+	if (task->antithetic) {
+	    InitState(state, task->initial, fightNum >> 1);
+	    state->antithetic = (fightNum & 1);
+	} else {
+	    InitState(state, task->initial, fightNum);
+	}
+	if (task->orders != NULL) {
+	    SetDeckOrder(state, task->initial,
+		    &task->orders[(size_t) i * state->deck.numCards]);
+	    ShuffleCards(state, state->deck.cards, task->numShuffled);
+	} else if (fullShuffle || forkCtx != NULL) {
+	    ShuffleSet(state, &state->deck);
+	} else {
+	    // Leave the whole deck unseen so that each card is picked at
+	    // random when it is dealt.  Cards that never get dealt never
+	    // need to be shuffled.
+	    state->numUnseen = state->deck.numCards;
+	}
+	state->numRolls = 0;
+	if (forkCtx != NULL) {
+	    ForkFight(forkCtx, state);
+	    result->expDmg     += forkCtx->dmg;
+	    result->expDmgSq   += forkCtx->dmg * forkCtx->dmg;
+	    result->expRounds  += forkCtx->numRounds;
+	    result->expRoundX  += forkCtx->roundX;
+	    result->forkRounds += forkCtx->rounds;
+	    result->forkLeaves += forkCtx->leaves;
+	    if (forkCtx->sampled)
+		result->sampledFights++;
+	    highDamage = MAX(highDamage, forkCtx->highDamage);
+	    lowDamage  = MIN(lowDamage,  forkCtx->lowDamage);
+	    highRounds = MAX(highRounds, forkCtx->highRounds);
+	    lowRounds  = MIN(lowRounds,  forkCtx->lowRounds);
+	    continue;
+	}
+	hitRoundX = false;
+	Simulate(state, localRoundX, &hitRoundX);
+Tally:
+	if (hitRoundX)
+	    timesRoundX++;
+	if (state->numRolls > 0)
+	    randomFights++;
+	if (doTilt) {
+	    double w = state->weight;
+
+	    result->sumWeight   += w;
+	    result->sumWeightSq += w * w;
+	    result->wDmg        += w * state->dmgDone;
+	    result->wDmgSq      += (w * state->dmgDone) * (w * state->dmgDone);
+	    result->wRounds     += w * state->round;
+	    if (hitRoundX) {
+		result->wRoundX   += w;
+		result->wRoundXSq += w * w;
+	    }
+	    if (state->dmgDone > tailDamage) {
+		result->wTail   += w;
+		result->wTailSq += w * w;
+	    }
+	}
+	total       += state->dmgDone;
+	totalRounds += state->round;
+	highDamage = MAX(highDamage, state->dmgDone);
+	lowDamage  = MIN(lowDamage,  state->dmgDone);
+	highRounds = MAX(highRounds, state->round);
+	lowRounds  = MIN(lowRounds,  state->round);
+	if (task->fightDmg != NULL)
+	    task->fightDmg[i] = state->dmgDone;
+	if (task->fightRounds != NULL)
+	    task->fightRounds[i] = state->round;
+	if (task->fightControls != NULL) {
+	    memcpy(&task->fightControls[i * NUM_ROLL_TYPES], state->rollExcess,
+		    sizeof(state->rollExcess));
+	}
+	if (showDamage) {
+	    fprintf(output, "Dmg done = %d\n", state->dmgDone);
+	}
+	dprintf("\n");
+    }
+    result->total       = total;
+    result->totalRounds = totalRounds;
+    result->highDamage  = highDamage;
+    result->lowDamage   = lowDamage;
+    result->highRounds  = highRounds;
+    result->lowRounds   = lowRounds;
+    result->timesRoundX = timesRoundX;
+    result->randomFights = randomFights;
+
+    if (forkCtx != NULL) {
+	free(forkCtx->nodes);
+	free(forkCtx);
+    }
+    free(lanes);
+
+#if defined(USING_WINDOWS)
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+/**
+ * Runs a batch of fights, split amongst numThreads threads.  Once all the
+ * threads are done, the results from each thread are totaled into one Result.
+ *
+ * The batch is described by a Task (its state and result are not used):
+ *
+ *   initial       The state each fight starts from.
+ *   firstFight    The fight number of the first fight.  Fight N always uses
+ *                 the same random seeds, so fights can be compared one by
+ *                 one with another batch that uses the same fight numbers.
+ *   numIterations Number of fights to run.
+ *   fightDmg      If not NULL, an array of numIterations ints that gets the
+ *                 damage done in each fight.
+ *   fightRounds   If not NULL, an array of numIterations ints that gets the
+ *                 number of rounds of each fight.
+ *   orders        If not NULL, fight i uses the deck order at
+ *                 orders[i * deck size] (see SetDeckOrder) instead of a
+ *                 shuffled deck.  The first numShuffled cards of that order
+ *                 are then shuffled.
+ *   antithetic    If true, fights 2N and 2N+1 form an antithetic pair.
+ *   fightControls If not NULL, an array of numIterations * NUM_ROLL_TYPES
+ *                 ints that gets the rollExcess totals of each fight.
+ *   fork          If true, each fight is explored with ForkFight, and the
+ *                 expected results go in the exp* fields of the Result.
+ *
+ * @param	batch		Describes the fights to run.
+ * @param	total		Returns the totaled results.
+ */
+static void RunFights(const Task *batch, Result *total)
+{
+    int         i          = 0;
+    int         numFights  = batch->numIterations;
+    int         done       = 0;
+    int         deckSize   = batch->initial->deck.numCards;
+    Result     *results    = NULL;
+    Task       *tasks      = NULL;
+#if defined(USING_WINDOWS)
+    HANDLE     *threads    = NULL;
+#else
+    pthread_t  *threads    = NULL;
+#endif
+
+    results = (Result *)    calloc(numThreads, sizeof(Result));
+    tasks   = (Task *)      calloc(numThreads, sizeof(Task));
+#if defined(USING_WINDOWS)
+    threads = (HANDLE *)    calloc(numThreads, sizeof(HANDLE));
+#else
+    threads = (pthread_t *) calloc(numThreads, sizeof(pthread_t));
+#endif
+
+    // Start all threads running.
+    for (i=0;i<numThreads;i++) {
+	int numIterations = numFights / numThreads;
+
+	// Make the first thread also do all the remainder # of iters.
+	if (i == 0)
+	    numIterations += (numFights - numIterations * numThreads);
+	tasks[i]               = *batch;
+	tasks[i].state         = states[i];
+	tasks[i].firstFight    = batch->firstFight + done;
+	tasks[i].numIterations = numIterations;
+	tasks[i].result        = &results[i];
+	if (batch->fightDmg != NULL)
+	    tasks[i].fightDmg    = &batch->fightDmg[done];
+	if (batch->fightRounds != NULL)
+	    tasks[i].fightRounds = &batch->fightRounds[done];
+	if (batch->orders != NULL)
+	    tasks[i].orders      = &batch->orders[(size_t) done * deckSize];
+	if (batch->fightControls != NULL) {
+	    tasks[i].fightControls =
+		&batch->fightControls[(size_t) done * NUM_ROLL_TYPES];
+	}
+	done += numIterations;
+#if defined(USING_WINDOWS)
+	threads[i] = CreateThread(NULL, 0, ThreadSimulate, (LPVOID) &tasks[i],
+			0, NULL);
+#else
+	pthread_create(&threads[i], NULL, ThreadSimulate, (void *) &tasks[i]);
+#endif
+    }
+
+    // Wait for all threads to complete.
+    for (i=0;i<numThreads;i++) {
+#if defined(USING_WINDOWS)
+	WaitForSingleObject(threads[i], INFINITE);
+#else
+	void *dummyRet;
+
+	pthread_join(threads[i], &dummyRet);
+#endif
+    }
+
+    // Total the results from all threads.
+    memset(total, 0, sizeof(Result));
+    total->lowRounds = 0x7fffffff;
+    total->lowDamage = 0x7fffffff;
+    for (i=0;i<numThreads;i++) {
+	total->total       += results[i].total;
+	total->totalRounds += results[i].totalRounds;
+	total->timesRoundX += results[i].timesRoundX;
+	total->randomFights += results[i].randomFights;
+	total->expDmg       += results[i].expDmg;
+	total->expDmgSq     += results[i].expDmgSq;
+	total->expRounds    += results[i].expRounds;
+	total->expRoundX    += results[i].expRoundX;
+	total->forkRounds   += results[i].forkRounds;
+	total->forkLeaves   += results[i].forkLeaves;
+	total->sampledFights += results[i].sampledFights;
+	total->sumWeight    += results[i].sumWeight;
+	total->sumWeightSq  += results[i].sumWeightSq;
+	total->wDmg         += results[i].wDmg;
+	total->wDmgSq       += results[i].wDmgSq;
+	total->wRounds      += results[i].wRounds;
+	total->wRoundX      += results[i].wRoundX;
+	total->wRoundXSq    += results[i].wRoundXSq;
+	total->wTail        += results[i].wTail;
+	total->wTailSq      += results[i].wTailSq;
+	total->highDamage   = MAX(total->highDamage, results[i].highDamage);
+	total->lowDamage    = MIN(total->lowDamage,  results[i].lowDamage);
+	total->highRounds   = MAX(total->highRounds, results[i].highRounds);
+	total->lowRounds    = MIN(total->lowRounds,  results[i].lowRounds);
+    }
+
+    free(results);
+    free(tasks);
+    free(threads);
+}
+
+// One change to the deck tried by the sensitivity analysis.
+typedef struct sensVariant {
+    char	desc[80];		// Description of the change.
+    double	delta;			// Mean change in dmg per fight.
+    double	ci;			// Half width of 95% confidence interval.
+    double	deltaPerMin;		// Change in dmg per minute.
+} SensVariant;
+
+/**
+ * Sort function for the sensitivity table (biggest improvement first).
+ */
+static int CompareVariants(const void *a, const void *b)
+{
+    const SensVariant *va = (const SensVariant *) a;
+    const SensVariant *vb = (const SensVariant *) b;
+
+    if (va->delta > vb->delta)
+	return -1;
+    if (va->delta < vb->delta)
+	return 1;
+    return 0;
+}
+
+/**
+ * Runs the fights for one variant of the deck and compares them fight by
+ * fight against the base deck.  Since fight N of both runs uses the same
+ * random seeds, the differences have a much lower variance than comparing
+ * two independent runs would.
+ *
+ * @param	variant		The initial state with the changed deck.
+ * @param	baseDmg		Damage of each fight of the base deck.
+ * @param	varDmg		Scratch space for numIters fight damages.
+ * @param	baseCost	Cost of the base deck.
+ * @param	v		Gets the results.
+ */
+static void EvalVariant(const State *variant, const int *baseDmg, int *varDmg,
+	int baseCost, SensVariant *v)
+{
+    Result result;
+    Task   batch;
+    int    i       = 0;
+    int    cost    = CalcCost(variant);
+    double sum     = 0;
+    double sumSq   = 0;
+    double baseAvg = 0;
+    double varAvg  = 0;
+    double var     = 0;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.initial       = variant;
+    batch.numIterations = numIters;
+    batch.fightDmg      = varDmg;
+    RunFights(&batch, &result);
+    for (i=0;i<numIters;i++) {
+	double d = (double) varDmg[i] - baseDmg[i];
+
+	sum     += d;
+	sumSq   += d * d;
+	baseAvg += baseDmg[i];
+    }
+    baseAvg /= numIters;
+    varAvg   = (double) result.total / numIters;
+    v->delta = sum / numIters;
+    if (numIters > 1) {
+	var = (sumSq - sum * v->delta) / (numIters - 1);
+	if (var < 0)
+	    var = 0;
+    }
+    v->ci          = 1.96 * sqrt(var / numIters);
+    v->deltaPerMin = (varAvg * 60) / (60 + cost * 2) -
+		     (baseAvg * 60) / (60 + baseCost * 2);
+}
+
+/**
+ * Estimates the marginal value of each card and rune in the deck.  For each
+ * distinct card, it tries removing one copy of it, raising the attack or hp
+ * of one copy by 10%, and replacing one copy with each of the candidate
+ * cards.  For each rune, it tries
+ * replacing it with each of the candidate runes.  Every variant is run with
+ * the same random seeds as the base deck, and the results are printed as a
+ * table ranked by the change in damage per fight.
+ */
+static void RunSensitivity(void)
+{
+    Result       result;
+    Task         batch;
+    State       *variant     = (State *) malloc(sizeof(State));
+    int         *baseDmg     = (int *) calloc(numIters, sizeof(int));
+    int         *varDmg      = (int *) calloc(numIters, sizeof(int));
+    SensVariant *variants    = NULL;
+    int          numVariants = 0;
+    int          maxVariants = 0;
+    int          baseCost    = CalcCost(&defaultState);
+    double       baseAvg     = 0;
+    int          i           = 0;
+    int          j           = 0;
+    int          k           = 0;
+
+    maxVariants = (defaultState.deck.numCards + defaultState.numRunes) *
+		  (numCandidates + 3);
+    variants    = (SensVariant *) calloc(maxVariants, sizeof(SensVariant));
+
+    memset(&batch, 0, sizeof(batch));
+    batch.initial       = &defaultState;
+    batch.numIterations = numIters;
+    batch.fightDmg      = baseDmg;
+    RunFights(&batch, &result);
+    baseAvg = (double) result.total / numIters;
+
+    for (i=0;i<defaultState.deck.numCards;i++) {
+	const char *name   = defaultState.deck.cards[i].name;
+	int         id     = defaultState.deck.cards[i].id;
+	int         copies = 0;
+	Card       *vc     = &variant->deck.cards[i];
+	char        who[64];
+
+	// Slots holding the same card are interchangeable, so only the
+	// first one needs to be tried.
+	for (j=0;j<i;j++) {
+	    if (defaultState.deck.cards[j].id == id)
+		break;
+	}
+	if (j < i)
+	    continue;
+	for (j=0;j<defaultState.deck.numCards;j++) {
+	    if (defaultState.deck.cards[j].id == id)
+		copies++;
+	}
+	// Each variant changes only one of the copies.
+	if (copies > 1)
+	    snprintf(who, sizeof(who), "%s (1 of x%d)", name, copies);
+	else
+	    snprintf(who, sizeof(who), "%s", name);
+
+	if (defaultState.deck.numCards > 1) {
+	    *variant = defaultState;
+	    RemoveCardFromSet(&variant->deck, i);
+	    snprintf(variants[numVariants].desc, sizeof(variants[0].desc),
+		    "%s: removed", who);
+	    EvalVariant(variant, baseDmg, varDmg, baseCost,
+		    &variants[numVariants++]);
+	}
+
+	*variant = defaultState;
+	vc->baseAtk += vc->baseAtk / 10;
+	InitCard(vc);
+	snprintf(variants[numVariants].desc, sizeof(variants[0].desc),
+		"%s: +10%% atk", who);
+	EvalVariant(variant, baseDmg, varDmg, baseCost,
+		&variants[numVariants++]);
+
+	*variant = defaultState;
+	vc->baseHp += vc->baseHp / 10;
+	InitCard(vc);
+	snprintf(variants[numVariants].desc, sizeof(variants[0].desc),
+		"%s: +10%% hp", who);
+	EvalVariant(variant, baseDmg, varDmg, baseCost,
+		&variants[numVariants++]);
+
+	for (k=0;k<numCandidates;k++) {
+	    const Card *c = FindCard(theCandidates[k]);
+
+	    if (c == NULL || c->id == id)
+		continue;
+	    *variant = defaultState;
+	    *vc      = *c;
+	    InitCard(vc);
+	    snprintf(variants[numVariants].desc, sizeof(variants[0].desc),
+		    "%s -> %s", who, c->name);
+	    EvalVariant(variant, baseDmg, varDmg, baseCost,
+		    &variants[numVariants++]);
+	}
+    }
+
+    for (i=0;i<defaultState.numRunes;i++) {
+	for (k=0;k<numCandidates;k++) {
+	    const Rune *rune = FindRune(theCandidates[k]);
+
+	    if (rune == NULL)
+		continue;
+	    // Skip runes that are already in the deck.
+	    for (j=0;j<defaultState.numRunes;j++) {
+		if (!strcmp(rune->name, defaultState.runes[j].name))
+		    break;
+	    }
+	    if (j < defaultState.numRunes)
+		continue;
+	    *variant = defaultState;
+	    variant->runes[i] = *rune;
+	    snprintf(variants[numVariants].desc, sizeof(variants[0].desc),
+		    "%s -> %s", defaultState.runes[i].name, rune->name);
+	    EvalVariant(variant, baseDmg, varDmg, baseCost,
+		    &variants[numVariants++]);
+	}
+    }
+
+    qsort(variants, numVariants, sizeof(SensVariant), CompareVariants);
+
+    fprintf(output, "Sensitivity analysis (%d fights per variant, "
+	    "seed %u):\n\n", numIters, runSeed);
+    fprintf(output, "Base deck: %5.1lf dmg per fight, %5.1lf dmg per "
+	    "minute\n\n", baseAvg, (baseAvg * 60) / (60 + baseCost * 2));
+    fprintf(output, "Rank  Change                                      "
+	    "Dmg/fight (95%% CI)   Dmg/min\n");
+    for (i=0;i<numVariants;i++) {
+	fprintf(output, "%4d  %-42s %+8.1lf +/- %6.1lf  %+7.1lf\n", i+1,
+		variants[i].desc, variants[i].delta, variants[i].ci,
+		variants[i].deltaPerMin);
+    }
+    fprintf(output, "\n\n");
+
+    free(variants);
+    free(varDmg);
+    free(baseDmg);
+    free(variant);
+}
+
+/**
+ * Prints the demon, the deck and the runes at the top of the results.
+ *
+ * @param	cost		The deck cost.
+ */
+static void PrintDeck(int cost)
+{
+    int i        = 0;
+    int deckTime = 60 + cost*2;
+
+    fprintf(output, "Demon: %s\n", defaultState.demon.name);
+    if (snapshotFile != NULL) {
+	fprintf(output, "Snapshot: %s (round %d, %d hp, %d dmg done)\n",
+		snapshotFile, defaultState.round, defaultState.hp,
+		defaultState.dmgDone);
+    }
+    fprintf(output,
+	    "Deck : (level %d, %d initial hp, %d cost, "
+	    "%d:%02d cooldown)\n\n",
+	    initialLevel, initialHp, cost,
+	    deckTime / 60, deckTime % 60);
+    for (i=0;i<defaultState.deck.numCards;i++)
+	fprintf(output, "%2d) %s\n", i+1, defaultState.deck.cards[i].name);
+    fprintf(output, "\nRunes:\n\n");
+    for (i=0;i<defaultState.numRunes;i++)
+	fprintf(output, "%s\n", defaultState.runes[i].name);
+    fprintf(output, "\n");
+}
+
+/**
+ * Prints the results of a run.
+ *
+ * @param	result		The totaled results.
+ * @param	numFights	The number of fights in the run.
+ * @param	cost		The deck cost.
+ */
+static void PrintResults(const Result *result, long long numFights, int cost)
+{
+    double dTotal = (double) result->total / numFights;
+
+#if 0
+    fprintf(output, "Total dmg over %lld runs: %lld\n",
+	    numFights, (long long) result->total);
+#endif
+    fprintf(output, "Lowest  number of rounds      : %d\n"
+	            "Highest number of rounds      : %d\n"
+		    "Average number of rounds      : %4.1lf\n",
+		    result->lowRounds, result->highRounds,
+		    (double) result->totalRounds / numFights);
+    if (result->timesRoundX > 0) {
+	fprintf(output, "Percent time hitting round %d : %4.1lf\n",
+		roundX, ((double) result->timesRoundX * 100.0f / numFights));
+    }
+    fprintf(output, "\n");
+    fprintf(output, "Lowest  damage                : %d\n"
+		    "Highest damage                : %d\n"
+	            "Average dmg per fight         : %5.1lf\n",
+		    result->lowDamage, result->highDamage, dTotal);
+    fprintf(output, "Average dmg per minute        : %5.1lf\n",
+	    (dTotal * 60) / (60 + cost * 2));
+    fprintf(output, "\n\n");
+}
+
+/**
+ * Checks whether anything in a fight other than the deck order uses random
+ * numbers.  If nothing does, every fight with the same deck order plays out
+ * exactly the same way.  Note that this is a conservative check.  Some of
+ * these abilities only roll dice in certain situations (e.g. Healing only
+ * when two cards are equally damaged).
+ *
+ * @param	state		The initial state.
+ * @return			The name of the first random ability found, or
+ *				NULL if only the deck order is random.
+ */
+static const char *FindRandomAbility(const State *state)
+{
+    static const int randomCardAttrs[] = {
+	ATTR_DODGE, ATTR_RESURRECTION, ATTR_SACRIFICE, ATTR_HEALING,
+	ATTR_REANIMATE, ATTR_D_REANIMATE, ATTR_CONCENTRATE,
+    };
+    static const int randomDemonAttrs[] = {
+	ATTR_TRAP, ATTR_MANA_CORRUPT, ATTR_DESTROY, ATTR_EXILE,
+    };
+    int i = 0;
+    int j = 0;
+
+    for (i=0;i<state->deck.numCards;i++) {
+	const Card *c = &state->deck.cards[i];
+
+	for (j=0;j<DIM(randomCardAttrs);j++) {
+	    if (randomCardAttrs[j] == ATTR_CONCENTRATE && avgConcentrate)
+		continue;
+	    if (HasAttr(c, randomCardAttrs[j], NULL))
+		return AttrName(randomCardAttrs[j]);
+	}
+    }
+    for (j=0;j<DIM(randomDemonAttrs);j++) {
+	if (HasAttr(&state->demon, randomDemonAttrs[j], NULL))
+	    return AttrName(randomDemonAttrs[j]);
+    }
+    for (i=0;i<state->numRunes;i++) {
+	switch (state->runes[i].attr.type) {
+	    case ATTR_FROST_BITE:
+		if (avgConcentrate)
+		    break;
+		// Fall through.
+	    case ATTR_NIMBLE_SOUL:
+	    case ATTR_DIRT:
+		return state->runes[i].name;
+	    default:
+		break;
+	}
+    }
+    return NULL;
+}
+
+/**
+ * Rearranges an array into the next lexicographically greater permutation.
+ * Equal elements are treated as identical, so repeatedly calling this on a
+ * sorted array visits each distinct ordering exactly once.
+ *
+ * @param	a		The array.
+ * @param	n		Number of elements.
+ * @return			False if the array was already the last
+ *				permutation (it is then left unchanged).
+ */
+static bool NextPermutation(unsigned char *a, int n)
+{
+    int           i   = n - 2;
+    int           j   = n - 1;
+    unsigned char tmp = 0;
+
+    while (i >= 0 && a[i] >= a[i+1])
+	i--;
+    if (i < 0)
+	return false;
+    while (a[j] <= a[i])
+	j--;
+    tmp = a[i]; a[i] = a[j]; a[j] = tmp;
+    for (i=i+1, j=n-1;i<j;i++, j--) {
+	tmp = a[i]; a[i] = a[j]; a[j] = tmp;
+    }
+    return true;
+}
+
+/**
+ * Sort function for bytes (ascending).
+ */
+static int CompareBytes(const void *a, const void *b)
+{
+    return *(const unsigned char *) a - *(const unsigned char *) b;
+}
+
+/**
+ * Sort function for ints (ascending).
+ */
+static int CompareInts(const void *a, const void *b)
+{
+    int ia = *(const int *) a;
+    int ib = *(const int *) b;
+
+    return (ia > ib) - (ia < ib);
+}
+
+#define MAX_EXACT_LINES		30
+
+/**
+ * Evaluates the deck exactly instead of with random fights.  If nothing in
+ * the fight is random except the shuffle, then each distinct order of the
+ * deck always gives the same result.  Each distinct order is equally likely
+ * (with probability prod(copies of each card)! / (deck size)!), so the exact
+ * results are the plain averages over the distinct orders.
+ *
+ * @param	cost		The deck cost.
+ * @return			True if the exact results were printed.  False
+ *				if the deck can't be evaluated exactly, in
+ *				which case the caller should use random fights.
+ */
+static bool RunExact(int cost)
+{
+    Result         result;
+    Task           batch;
+    const State   *initial   = &defaultState;
+    int            n         = initial->deck.numCards;
+    unsigned char  perm[MAX_CARDS_IN_DECK];
+    unsigned char *orders    = NULL;
+    int           *fightDmg  = NULL;
+    int           *rounds    = NULL;
+    const char    *reason    = NULL;
+    double         numOrders = 1;
+    long long      k         = 0;
+    int            i         = 0;
+    int            j         = 0;
+    int            copies    = 0;
+    int            numValues = 0;
+
+    reason = FindRandomAbility(initial);
+    if (reason != NULL) {
+	fprintf(output, "Exact evaluation not possible because %s is "
+		"random.\nUsing random fights instead.\n\n", reason);
+	return false;
+    }
+
+    // Cards with the same name are interchangeable, so each slot is
+    // labeled with the first slot holding the same card.  Sorting the
+    // labels gives the first distinct order.
+    for (i=0;i<n;i++) {
+	for (j=0;j<i;j++) {
+	    if (initial->deck.cards[i].id == initial->deck.cards[j].id)
+		break;
+	}
+	perm[i] = j;
+    }
+    qsort(perm, n, 1, CompareBytes);
+
+    // Number of distinct orders = n! / prod(copies!).
+    for (i=0;i<n;i++) {
+	copies = (i > 0 && perm[i] == perm[i-1]) ? copies + 1 : 1;
+	numOrders = numOrders * (i + 1) / copies;
+    }
+    if (numOrders > exactLimit) {
+	fprintf(output, "Exact evaluation not possible because the deck has "
+		"%.0lf distinct orders (limit %d).\nUsing random fights "
+		"instead.\n\n", numOrders, exactLimit);
+	return false;
+    }
+
+    orders   = (unsigned char *) malloc((size_t) numOrders * MAX(n, 1));
+    fightDmg = (int *) calloc((size_t) numOrders, sizeof(int));
+    rounds   = (int *) calloc((size_t) numOrders, sizeof(int));
+    k = 0;
+    do {
+	memcpy(&orders[k * n], perm, n);
+	k++;
+    } while (NextPermutation(perm, n));
+
+    memset(&batch, 0, sizeof(batch));
+    batch.initial       = initial;
+    batch.numIterations = (int) k;
+    batch.orders        = orders;
+    batch.fightDmg      = fightDmg;
+    batch.fightRounds   = rounds;
+    RunFights(&batch, &result);
+
+    // Safety net: the check above should have caught any random ability.
+    if (result.randomFights > 0) {
+	fprintf(output, "Exact evaluation not possible because %d of %lld "
+		"deck orders had random events.\nUsing random fights "
+		"instead.\n\n", result.randomFights, k);
+	free(rounds);
+	free(fightDmg);
+	free(orders);
+	return false;
+    }
+
+    PrintDeck(cost);
+    fprintf(output, "Results of exact evaluation (%lld distinct deck "
+	    "orders):\n\n", k);
+    PrintResults(&result, k, cost);
+
+    // Print the damage distribution.
+    qsort(fightDmg, (size_t) k, sizeof(int), CompareInts);
+    for (i=0;i<k;i++) {
+	if (i == 0 || fightDmg[i] != fightDmg[i-1])
+	    numValues++;
+    }
+    fprintf(output, "Damage distribution (%d distinct values):\n\n",
+	    numValues);
+    if (numValues <= MAX_EXACT_LINES) {
+	for (i=0;i<k;i=j) {
+	    for (j=i;j<k && fightDmg[j] == fightDmg[i];j++)
+		;
+	    fprintf(output, "%8d : %5.1lf%%\n", fightDmg[i],
+		    (j - i) * 100.0 / k);
+	}
+    } else {
+	static const int percentiles[] = { 5, 10, 25, 50, 75, 90, 95 };
+
+	for (i=0;i<DIM(percentiles);i++) {
+	    fprintf(output, "%2d%% of fights do at most %d\n",
+		    percentiles[i],
+		    fightDmg[(k * percentiles[i] + 99) / 100 - 1]);
+	}
+    }
+    fprintf(output, "\n\n");
+
+    free(rounds);
+    free(fightDmg);
+    free(orders);
+    return true;
+}
+
+// One stratum for stratified sampling: all the shuffles that deal the same
+// first cards.
+typedef struct stratum {
+    unsigned char prefix[MAX_CARDS_IN_DECK];	// Deck slots dealt first.
+    double	  prob;				// Probability of stratum.
+    int		  numFights;			// Fights run so far.
+    int		  alloc;			// Fights in next batch.
+    double	  sum;				// Sum of dmg.
+    double	  sumSq;			// Sum of dmg squared.
+    double	  sumRounds;			// Sum of rounds.
+    int		  timesRoundX;			// Fights reaching round X.
+} Stratum;
+
+/**
+ * Recursively finds every distinct sequence of the first k cards dealt, and
+ * the probability of each one.
+ *
+ * @param	label		For each deck slot, the first slot holding the
+ *				same card.
+ * @param	left		For each slot label, the number of copies not
+ *				yet dealt (only used at label slots).
+ * @param	n		Number of cards in the deck.
+ * @param	depth		Number of cards dealt so far.
+ * @param	k		Number of cards to deal.
+ * @param	prefix		The cards dealt so far.
+ * @param	prob		The probability of dealing prefix.
+ * @param	strata		Array of MAX_STRATA strata to fill in.
+ * @param	numStrata	Number of strata filled in so far.
+ * @return			False if there were too many strata.
+ */
+static bool FindStrata(const unsigned char *label, int *left, int n,
+	int depth, int k, unsigned char *prefix, double prob,
+	Stratum *strata, int *numStrata)
+{
+    int i = 0;
+
+    if (depth == k) {
+	if (*numStrata >= MAX_STRATA)
+	    return false;
+	memcpy(strata[*numStrata].prefix, prefix, k);
+	strata[*numStrata].prob = prob;
+	(*numStrata)++;
+	return true;
+    }
+    for (i=0;i<n;i++) {
+	if (label[i] != i || left[i] == 0)
+	    continue;
+	prefix[depth] = i;
+	left[i]--;
+	if (!FindStrata(label, left, n, depth + 1, k, prefix,
+		    prob * (left[i] + 1) / (n - depth), strata, numStrata))
+	    return false;
+	left[i]++;
+    }
+    return true;
+}
+
+/**
+ * Decides how many of the next fights go to each stratum.  With proportional
+ * allocation, each stratum gets fights in proportion to its probability.
+ * With Neyman allocation, it is in proportion to the probability times the
+ * standard deviation seen so far, which puts more fights where the results
+ * vary the most.  Every stratum gets at least minFights fights.
+ *
+ * @param	strata		The strata.  Sets the alloc field of each.
+ * @param	numStrata	Number of strata.
+ * @param	numFights	Number of fights to allocate.
+ * @param	minFights	Minimum number of fights per stratum.
+ * @param	neyman		True for Neyman allocation.
+ */
+static void AllocateStrata(Stratum *strata, int numStrata, int numFights,
+	int minFights, bool neyman)
+{
+    double *weight    = (double *) calloc(numStrata, sizeof(double));
+    double  sumWeight = 0;
+    int     left      = numFights - minFights * numStrata;
+    int     given     = 0;
+    int     i         = 0;
+
+    for (i=0;i<numStrata;i++) {
+	Stratum *st = &strata[i];
+
+	weight[i] = st->prob;
+	if (neyman && st->numFights > 1) {
+	    double mean = st->sum / st->numFights;
+	    double var  = (st->sumSq - st->sum * mean) / (st->numFights - 1);
+
+	    weight[i] = st->prob * sqrt(MAX(var, 0));
+	}
+	sumWeight += weight[i];
+    }
+    // If every stratum always does the same damage, fall back to
+    // proportional allocation.
+    if (sumWeight <= 0) {
+	for (i=0;i<numStrata;i++) {
+	    weight[i]  = strata[i].prob;
+	    sumWeight += weight[i];
+	}
+    }
+    for (i=0;i<numStrata;i++) {
+	strata[i].alloc = minFights + (int) (left * weight[i] / sumWeight);
+	given += strata[i].alloc;
+    }
+    // Hand out the fights lost to rounding down, one each to the strata in
+    // the order they were found.  There are fewer of them than strata.
+    for (i=0;given<numFights;i=(i+1)%numStrata) {
+	strata[i].alloc++;
+	given++;
+    }
+    free(weight);
+}
+
+/**
+ * Runs the fights allocated to each stratum (see AllocateStrata) and adds
+ * their results to the strata.
+ *
+ * @param	strata		The strata.
+ * @param	numStrata	Number of strata.
+ * @param	k		Number of cards dealt that define a stratum.
+ * @param	firstFight	Fight number of the first fight in the batch.
+ * @param	label		For each deck slot, the first slot holding the
+ *				same card.
+ * @param	total		Gets the results of the batch.
+ * @return			Number of fights run.
+ */
+static int RunStrata(Stratum *strata, int numStrata, int k, int firstFight,
+	const unsigned char *label, Result *total)
+{
+    Task           batch;
+    int            n         = defaultState.deck.numCards;
+    int            numFights = 0;
+    unsigned char *orders    = NULL;
+    int           *fightDmg  = NULL;
+    int           *rounds    = NULL;
+    int            fight     = 0;
+    int            h         = 0;
+    int            i         = 0;
+    int            j         = 0;
+
+    for (h=0;h<numStrata;h++)
+	numFights += strata[h].alloc;
+    orders   = (unsigned char *) malloc((size_t) numFights * n);
+    fightDmg = (int *) calloc(numFights, sizeof(int));
+    rounds   = (int *) calloc(numFights, sizeof(int));
+
+    // The deck is dealt from the end, so the stratum's cards go at the end
+    // and the rest of the cards get shuffled at the front.
+    for (h=0;h<numStrata;h++) {
+	unsigned char order[MAX_CARDS_IN_DECK];
+	int           used[MAX_CARDS_IN_DECK];
+
+	memset(used, 0, sizeof(used));
+	for (i=0;i<k;i++) {
+	    order[n-1-i] = strata[h].prefix[i];
+	    used[strata[h].prefix[i]]++;
+	}
+	for (i=0, j=0;i<n;i++) {
+	    if (used[label[i]] > 0)
+		used[label[i]]--;
+	    else
+		order[j++] = label[i];
+	}
+	for (i=0;i<strata[h].alloc;i++)
+	    memcpy(&orders[(size_t) (fight++) * n], order, n);
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    batch.initial       = &defaultState;
+    batch.firstFight    = firstFight;
+    batch.numIterations = numFights;
+    batch.orders        = orders;
+    batch.numShuffled   = n - k;
+    batch.fightDmg      = fightDmg;
+    batch.fightRounds   = rounds;
+    RunFights(&batch, total);
+
+    for (h=0, fight=0;h<numStrata;h++) {
+	Stratum *st = &strata[h];
+
+	for (i=0;i<st->alloc;i++, fight++) {
+	    st->sum       += fightDmg[fight];
+	    st->sumSq     += (double) fightDmg[fight] * fightDmg[fight];
+	    st->sumRounds += rounds[fight];
+	    if (rounds[fight] >= roundX)
+		st->timesRoundX++;
+	}
+	st->numFights += st->alloc;
+    }
+
+    free(rounds);
+    free(fightDmg);
+    free(orders);
+    return numFights;
+}
+
+/**
+ * Runs the simulation with stratified sampling over the opening cards.  The
+ * first few cards dealt largely decide the fight, so the shuffles are split
+ * into strata by their first k cards.  Each stratum gets its share of the
+ * fights (see AllocateStrata) and the results are combined by weighting each
+ * stratum by its probability.  This gives a lower variance than plain random
+ * fights for the same number of fights.
+ *
+ * @param	cost		The deck cost.
+ */
+static void RunStratified(int cost)
+{
+    Stratum       *strata    = (Stratum *) calloc(MAX_STRATA, sizeof(Stratum));
+    int            n         = defaultState.deck.numCards;
+    int            k         = MIN(stratifyCards, n);
+    int            numStrata = 0;
+    int            done      = 0;
+    int            pilot     = 0;
+    unsigned char  label[MAX_CARDS_IN_DECK];
+    unsigned char  prefix[MAX_CARDS_IN_DECK];
+    int            left[MAX_CARDS_IN_DECK];
+    Result         result;
+    Result         total;
+    double         mean      = 0;
+    double         varMean   = 0;
+    double         varFight  = 0;
+    double         avgRounds = 0;
+    double         roundXPct = 0;
+    int            h         = 0;
+    int            i         = 0;
+    int            j         = 0;
+
+    // Label each slot with the first slot holding the same card.
+    memset(left, 0, sizeof(left));
+    for (i=0;i<n;i++) {
+	for (j=0;j<i;j++) {
+	    if (defaultState.deck.cards[i].id == defaultState.deck.cards[j].id)
+		break;
+	}
+	label[i] = j;
+	left[j]++;
+    }
+    if (!FindStrata(label, left, n, 0, k, prefix, 1.0, strata, &numStrata)) {
+	fprintf(stderr, "Error: Too many strata.  Use a smaller -stratify.\n");
+	exit(1);
+    }
+    if (numIters < 2 * numStrata) {
+	fprintf(stderr, "Error: %d strata need at least %d fights.  Use a "
+		"smaller -stratify or a larger -iter.\n", numStrata,
+		2 * numStrata);
+	exit(1);
+    }
+
+    // With Neyman allocation, a pilot run estimates the variance of each
+    // stratum first.
+    if (doNeyman)
+	pilot = MAX(numIters * PILOT_PERCENT / 100, 2 * numStrata);
+    else
+	pilot = numIters;
+    AllocateStrata(strata, numStrata, pilot, 2, false);
+    done = RunStrata(strata, numStrata, k, 0, label, &total);
+    if (done < numIters) {
+	AllocateStrata(strata, numStrata, numIters - done, 0, true);
+	done += RunStrata(strata, numStrata, k, done, label, &result);
+	total.highDamage = MAX(total.highDamage, result.highDamage);
+	total.lowDamage  = MIN(total.lowDamage,  result.lowDamage);
+	total.highRounds = MAX(total.highRounds, result.highRounds);
+	total.lowRounds  = MIN(total.lowRounds,  result.lowRounds);
+    }
+
+    // Combine the strata.
+    for (h=0;h<numStrata;h++) {
+	Stratum *st = &strata[h];
+	double   m  = st->sum / st->numFights;
+
+	mean      += st->prob * m;
+	avgRounds += st->prob * st->sumRounds / st->numFights;
+	roundXPct += st->prob * st->timesRoundX * 100.0 / st->numFights;
+    }
+    for (h=0;h<numStrata;h++) {
+	Stratum *st  = &strata[h];
+	double   m   = st->sum / st->numFights;
+	double   var = 0;
+
+	if (st->numFights > 1)
+	    var = MAX((st->sumSq - st->sum * m) / (st->numFights - 1), 0);
+	varMean  += st->prob * st->prob * var / st->numFights;
+	varFight += st->prob * (var + (m - mean) * (m - mean));
+    }
+
+    PrintDeck(cost);
+    fprintf(output, "Results of stratified simulation (%d fights, %d strata "
+	    "by first %d cards, %s allocation):\n\n", done, numStrata, k,
+	    doNeyman ? "Neyman" : "proportional");
+    fprintf(output, "Lowest  number of rounds      : %d\n"
+	            "Highest number of rounds      : %d\n"
+		    "Average number of rounds      : %4.1lf\n",
+		    total.lowRounds, total.highRounds, avgRounds);
+    if (roundXPct > 0) {
+	fprintf(output, "Percent time hitting round %d : %4.1lf\n",
+		roundX, roundXPct);
+    }
+    fprintf(output, "\n");
+    fprintf(output, "Lowest  damage                : %d\n"
+		    "Highest damage                : %d\n"
+	            "Average dmg per fight         : %5.1lf\n",
+		    total.lowDamage, total.highDamage, mean);
+    fprintf(output, "Average dmg per minute        : %5.1lf\n",
+	    (mean * 60) / (60 + cost * 2));
+    fprintf(output, "Standard error (stratified)   : %5.2lf\n",
+	    sqrt(varMean));
+    fprintf(output, "Standard error (unstratified) : %5.2lf (estimated)\n",
+	    sqrt(varFight / done));
+    fprintf(output, "\n\n");
+
+    free(strata);
+}
+
+/**
+ * Solves the fight exactly.  The deck starts out with no order at all
+ * (numUnseen is the whole deck), so that each card dealt is a random event
+ * like any other, and every state the fight can reach is solved once (see
+ * SolveNode).  This only works when there aren't too many different states,
+ * which is the case for small decks against demons with few random
+ * abilities.
+ *
+ * @param	cost		The deck cost.
+ * @return			True if the fight was solved.  False if there
+ *				were too many states, in which case the caller
+ *				should use random fights.
+ */
+static bool RunSolve(int cost)
+{
+    SolveCtx    *ctx    = (SolveCtx *) calloc(1, sizeof(SolveCtx));
+    Result       result;
+    SolveValue   v;
+    bool         solved = false;
+    unsigned int i      = 0;
+
+    ctx->maxDepth  = maxRounds + 2;
+    ctx->nodes     = (State *) malloc((ctx->maxDepth + 1) * sizeof(State));
+    ctx->paths     = (ForkPath *) calloc(ctx->maxDepth, sizeof(ForkPath));
+    ctx->tableSize = 1;
+    while (ctx->tableSize < 2 * (unsigned int) solveLimit)
+	ctx->tableSize <<= 1;
+    ctx->table     = (SolveEntry *) calloc(ctx->tableSize, sizeof(SolveEntry));
+
+    memcpy(&ctx->nodes[0], &defaultState, sizeof(State));
+    ctx->nodes[0].numUnseen = ctx->nodes[0].deck.numCards;
+    v = SolveNode(ctx, 0);
+
+    if (ctx->failed != NULL) {
+	fprintf(output, "Exact solution not possible because %s (%d "
+		"states solved, limit %d).\nUsing random fights instead.\n\n",
+		ctx->failed, ctx->numStates, solveLimit);
+    } else {
+	int dmgDone = defaultState.dmgDone;	// From a snapshot.
+
+	// The totals are in millionths of a fight, to keep the decimals.
+	memset(&result, 0, sizeof(result));
+	result.total       = (long long) ((dmgDone + v.dmg) * 1000000 + 0.5);
+	result.totalRounds = (long long) (v.rounds * 1000000 + 0.5);
+	result.timesRoundX = (int) (v.roundX * 1000000 + 0.5);
+	result.lowDamage   = dmgDone + v.lowDamage;
+	result.highDamage  = dmgDone + v.highDamage;
+	result.lowRounds   = v.lowRounds;
+	result.highRounds  = v.highRounds;
+
+	PrintDeck(cost);
+	fprintf(output, "Results of exact solution (%d states, %lld rounds "
+		"simulated):\n\n", ctx->numStates, ctx->rounds);
+	PrintResults(&result, 1000000, cost);
+	solved = true;
+    }
+
+    for (i=0;i<ctx->tableSize;i++)
+	free(ctx->table[i].key);
+    free(ctx->table);
+    free(ctx->paths);
+    free(ctx->nodes);
+    free(ctx);
+    return solved;
+}
+
+/**
+ * Returns the standard error of an importance sampling estimate.
+ *
+ * @param	sum		Sum of the weighted values.
+ * @param	sumSq		Sum of the squares of the weighted values.
+ * @param	n		The number of fights.
+ * @return			The standard error of sum / n.
+ */
+static double WeightedError(double sum, double sumSq, int n)
+{
+    double mean = sum / n;
+
+    if (n < 2)
+	return 0;
+    return sqrt(MAX((sumSq - sum * mean) / (n - 1), 0) / n);
+}
+
+/**
+ * Does an in-place fast Fourier transform.  The size must be a power of 2.
+ * The inverse transform is not scaled by 1/n.
+ *
+ * @param	re		The real parts.
+ * @param	im		The imaginary parts.
+ * @param	n		The size.
+ * @param	inverse		True for the inverse transform.
+ */
+static void FFT(double *re, double *im, int n, bool inverse)
+{
+    int i   = 0;
+    int j   = 0;
+    int len = 0;
+
+    // Put the entries in bit reversed order.
+    for (i=1,j=0;i<n;i++) {
+	int bit = n >> 1;
+
+	for (;j & bit;bit>>=1)
+	    j ^= bit;
+	j ^= bit;
+	if (i < j) {
+	    double t = re[i];
+
+	    re[i] = re[j];
+	    re[j] = t;
+	    t     = im[i];
+	    im[i] = im[j];
+	    im[j] = t;
+	}
+    }
+    for (len=2;len<=n;len<<=1) {
+	double angle = (inverse ? 2 : -2) * M_PI / len;
+	double wRe   = cos(angle);
+	double wIm   = sin(angle);
+
+	for (i=0;i<n;i+=len) {
+	    double uRe = 1;
+	    double uIm = 0;
+
+	    for (j=0;j<len/2;j++) {
+		int    a   = i + j;
+		int    b   = i + j + len/2;
+		double tRe = re[b] * uRe - im[b] * uIm;
+		double tIm = re[b] * uIm + im[b] * uRe;
+		double t   = uRe * wRe - uIm * wIm;
+
+		re[b] = re[a] - tRe;
+		im[b] = im[a] - tIm;
+		re[a] += tRe;
+		im[a] += tIm;
+		uIm    = uRe * wIm + uIm * wRe;
+		uRe    = t;
+	    }
+	}
+    }
+}
+
+/**
+ * Runs the simulation and then projects the total damage over an event
+ * window of -window minutes.  The deck fights once per cooldown of
+ * 60 + cost*2 seconds (the same as for the dmg per minute), so a window
+ * holds k fights.  The damages of the fights are put in a histogram of at
+ * most WINDOW_BINS bins, and the distribution of the sum of k independent
+ * fights is the histogram convolved with itself k times.  That is done in
+ * one go by raising its Fourier transform to the power k, so it takes about
+ * as long for a day as for an hour.
+ *
+ * Each fight is counted at the bottom of its bin, plus the average offset
+ * within the bins, so the averages are exact and the percentiles are
+ * accurate to within a few bin widths.
+ *
+ * @param	cost		The deck cost.
+ */
+static void RunWindow(int cost)
+{
+    static const double percents[] = { 1, 5, 10, 25, 50, 75, 90, 95, 99 };
+    Result  result;
+    Task    batch;
+    int     n         = numIters;
+    int     k         = windowMinutes * 60 / (60 + cost * 2);
+    int    *fightDmg  = (int *) calloc(n, sizeof(int));
+    int     width     = 0;
+    int     numBins   = 0;
+    int     size      = 1;
+    int     i         = 0;
+    int     j         = 0;
+    double *re        = NULL;
+    double *im        = NULL;
+    double  sum       = 0;
+    double  sumSq     = 0;
+    double  offset    = 0;
+    double  mean      = 0;
+    double  sd        = 0;
+    double  cumulative = 0;
+
+    if (k < 1) {
+	fprintf(stderr, "Error: A window of %d minutes is shorter than the "
+		"cooldown of %d seconds.\n", windowMinutes, 60 + cost * 2);
+	exit(1);
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    batch.initial       = &defaultState;
+    batch.numIterations = n;
+    batch.fightDmg      = fightDmg;
+    RunFights(&batch, &result);
+
+    width   = result.highDamage / WINDOW_BINS + 1;
+    numBins = result.highDamage / width + 1;
+    while (size < (long long) k * (numBins - 1) + 1)
+	size <<= 1;
+    re = (double *) calloc(size, sizeof(double));
+    im = (double *) calloc(size, sizeof(double));
+    for (i=0;i<n;i++) {
+	re[fightDmg[i] / width] += 1.0 / n;
+	offset += (fightDmg[i] % width) / (double) n;
+	sum    += fightDmg[i];
+	sumSq  += (double) fightDmg[i] * fightDmg[i];
+    }
+    mean = sum / n;
+    if (n > 1)
+	sd = sqrt(MAX((sumSq - sum * mean) / (n - 1), 0));
+
+    // The size is big enough that the k-fold sum doesn't wrap around.
+    FFT(re, im, size, false);
+    for (i=0;i<size;i++) {
+	double r     = pow(sqrt(re[i] * re[i] + im[i] * im[i]), k);
+	double angle = atan2(im[i], re[i]) * k;
+
+	re[i] = r * cos(angle);
+	im[i] = r * sin(angle);
+    }
+    FFT(re, im, size, true);
+
+    PrintDeck(cost);
+    fprintf(output, "Results of simulation (%d fights):\n\n", n);
+    PrintResults(&result, n, cost);
+    fprintf(output, "Event window of %d minutes (%d fights):\n\n",
+	    windowMinutes, k);
+    fprintf(output, "Average total dmg             : %.1lf\n", mean * k);
+    fprintf(output, "Std dev of total dmg          : %.1lf\n", sd * sqrt(k));
+    for (i=0,j=0;i<DIM(percents);i++) {
+	// Rounding errors can make some entries slightly negative.
+	while (j < size - 1 && cumulative + MAX(re[j] / size, 0) <
+		percents[i] / 100) {
+	    cumulative += MAX(re[j] / size, 0);
+	    j++;
+	}
+	fprintf(output, "Total dmg at %2.0lf%%             : %.0lf\n",
+		percents[i], (double) j * width + offset * k);
+    }
+    fprintf(output, "\n\n");
+
+    free(re);
+    free(im);
+    free(fightDmg);
+}
+
+/**
+ * Runs the simulation with importance sampling (-tilt).  Some kinds of
+ * random decisions are made more or less likely, so that rare outcomes
+ * (like reaching a late round, or doing a lot of damage) happen more often.
+ * Each fight is weighted by the likelihood ratio of its decisions (see
+ * Chance()), so the weighted averages are unbiased estimates of the
+ * results without the shift.  The effective sample size shows how many
+ * plain fights the weighted fights are worth for the average damage.
+ *
+ * @param	cost		The deck cost.
+ */
+static void RunTilt(int cost)
+{
+    Result result;
+    Task   batch;
+    int    n      = numIters;
+    int    i      = 0;
+    double ess    = 0;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.initial       = &defaultState;
+    batch.numIterations = n;
+    RunFights(&batch, &result);
+
+    if (result.sumWeightSq > 0)
+	ess = result.sumWeight * result.sumWeight / result.sumWeightSq;
+    result.total       = (long long) (result.wDmg + 0.5);
+    result.totalRounds = (long long) (result.wRounds + 0.5);
+    // The chance of reaching round X is printed below, more precisely.
+    result.timesRoundX = 0;
+
+    PrintDeck(cost);
+    fprintf(output, "Results of simulation (%d fights, importance "
+	    "sampling):\n\n", n);
+    PrintResults(&result, n, cost);
+    fprintf(output, "Importance sampling:\n\n");
+    for (i=0;i<NUM_ROLL_TYPES;i++) {
+	if (tiltPercent[i] != 0) {
+	    fprintf(output, "Chance of %-11s shifted by %+d%%\n",
+		    rollNames[i], tiltPercent[i]);
+	}
+    }
+    fprintf(output, "\nThe averages above are weighted.  The lowest and "
+	    "highest rounds and damage\nare of the shifted fights.\n\n");
+    fprintf(output, "Average dmg per fight         : %5.1lf (+/- %.2lf)\n",
+	    result.wDmg / n, WeightedError(result.wDmg, result.wDmgSq, n));
+    fprintf(output, "Percent time hitting round %d : %.4lf (+/- %.4lf)\n",
+	    roundX, result.wRoundX * 100 / n,
+	    WeightedError(result.wRoundX, result.wRoundXSq, n) * 100);
+    fprintf(output, "Percent dmg above %-7d     : %.4lf (+/- %.4lf)\n",
+	    tailDamage, result.wTail * 100 / n,
+	    WeightedError(result.wTail, result.wTailSq, n) * 100);
+    fprintf(output, "Average weight                : %.4lf\n",
+	    result.sumWeight / n);
+    fprintf(output, "Effective sample size         : %.0lf\n", ess);
+    fprintf(output, "\n\n");
+}
+
+/**
+ * Runs the simulation with the -fork engine.  Each fight starts from a
+ * random deck order like normal, but then all the ways the fight can go are
+ * explored with their probabilities, so that rounds that happen the same
+ * way in many fights are only simulated once.  The results are the
+ * expected values over all the fights.
+ *
+ * @param	cost		The deck cost.
+ */
+static void RunFork(int cost)
+{
+    Result result;
+    Task   batch;
+    int    n      = numIters;
+    double mean   = 0;
+    double se     = 0;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.initial       = &defaultState;
+    batch.numIterations = n;
+    batch.fork          = true;
+    RunFights(&batch, &result);
+
+    mean = result.expDmg / n;
+    if (n > 1) {
+	se = sqrt(MAX((result.expDmgSq - result.expDmg * mean) / (n - 1), 0) /
+		  n);
+    }
+    result.total       = (long long) (result.expDmg + 0.5);
+    result.totalRounds = (long long) (result.expRounds + 0.5);
+    result.timesRoundX = (int) (result.expRoundX + 0.5);
+
+    PrintDeck(cost);
+    fprintf(output, "Results of simulation (%d fights, exploring random "
+	    "events):\n\n", n);
+    PrintResults(&result, n, cost);
+    fprintf(output, "Fight trees:\n\n");
+    fprintf(output, "Outcomes explored per fight   : %5.1lf\n",
+	    (double) result.forkLeaves / n);
+    fprintf(output, "Rounds simulated per fight    : %5.1lf\n",
+	    (double) result.forkRounds / n);
+    fprintf(output, "Percent fights partly sampled : %4.1lf\n",
+	    result.sampledFights * 100.0 / n);
+    fprintf(output, "Standard error of avg dmg     : %5.2lf\n", se);
+    fprintf(output, "\n\n");
+}
+
+/**
+ * Solves the linear system a * x = b by Gaussian elimination with partial
+ * pivoting.  The matrix a is n by n, stored by rows, and is destroyed.
+ *
+ * @param	a		The matrix.
+ * @param	b		The right hand side.  Gets the solution x.
+ * @param	n		The size of the system.
+ * @return			False if the matrix is singular.
+ */
+static bool SolveLinear(double *a, double *b, int n)
+{
+    int i = 0;
+    int j = 0;
+    int k = 0;
+
+    for (i=0;i<n;i++) {
+	int    pivot = i;
+	double tmp   = 0;
+
+	for (j=i+1;j<n;j++) {
+	    if (fabs(a[j*n+i]) > fabs(a[pivot*n+i]))
+		pivot = j;
+	}
+	if (fabs(a[pivot*n+i]) < 1e-12)
+	    return false;
+	for (k=0;k<n;k++) {
+	    tmp = a[i*n+k]; a[i*n+k] = a[pivot*n+k]; a[pivot*n+k] = tmp;
+	}
+	tmp = b[i]; b[i] = b[pivot]; b[pivot] = tmp;
+	for (j=i+1;j<n;j++) {
+	    double f = a[j*n+i] / a[i*n+i];
+
+	    for (k=i;k<n;k++)
+		a[j*n+k] -= f * a[i*n+k];
+	    b[j] -= f * b[i];
+	}
+    }
+    for (i=n-1;i>=0;i--) {
+	for (k=i+1;k<n;k++)
+	    b[i] -= a[i*n+k] * b[k];
+	b[i] /= a[i*n+i];
+    }
+    return true;
+}
+
+// The estimator (-estimate) predicts the average damage of a deck from a
+// few features of it, with weights fitted to simulated decks saved by
+// -calibrate.  The features are 1, and the damage and the number of rounds
+// of a fight played with average outcomes (see PlainFight).  Demons differ
+// a lot in what the plain fight misses, so the weights are fitted to the
+// decks simulated against the same demon when there are enough of them.
+typedef struct estimateRow {
+    double	features[NUM_EST_FEATURES];
+    double	dmg;			// Simulated average dmg per fight.
+    char       *demon;
+} EstimateRow;
+
+// A card on the field in a plain fight (see PlainFight).
+typedef struct plainCard {
+    double	atk;
+    double	hp;
+    double	bonus;			// Average extra dmg of each attack.
+    double	backstab;		// Extra dmg of the first attack.
+    int		vendetta;		// Extra dmg per card in the grave.
+    int		growth;			// Atk gained per attack.
+    double	hit;			// Chance of being hit (dodge).
+    int		parry;
+} PlainCard;
+
+/**
+ * Plays a fight with average outcomes instead of random ones.  Only the
+ * cards' attack, hp and timing and their most common abilities (dodge,
+ * parry, concentrate, warpath, backstab, vendetta and bloodthirsty) are
+ * used, against the demon's attack, parry, curse, damnation, snipe,
+ * counterattack and retaliation.  The cards are dealt in deck order
+ * starting from a given card.
+ *
+ * @param	initial		The state the fight starts from.
+ * @param	first		The deck slot of the first card dealt.
+ * @param	rounds		Gets the number of rounds.
+ * @return			The damage done.
+ */
+static double PlainFight(const State *initial, int first, int *rounds)
+{
+    const CardSet *d         = &initial->deck;
+    const Card    *demon     = &initial->demon;
+    int            n         = d->numCards;
+    double         hp        = initial->hp;
+    double         total     = 0;
+    int            round     = 0;
+    int            dealt     = 0;
+    int            numHand   = 0;
+    int            numField  = 0;
+    int            numGrave  = 0;
+    int            demonParry = 0;
+    int            curse     = 0;
+    int            damnation = 0;
+    int            snipe     = 0;
+    int            counter   = 0;
+    int            numCountered = 0;
+    int            level     = 0;
+    int            i         = 0;
+    int            j         = 0;
+    int            hand[MAX_CARDS_IN_HAND];
+    int            ready[MAX_CARDS_IN_HAND];
+    PlainCard      field[MAX_CARDS_IN_SET];
+
+    HasAttr(demon, ATTR_PARRY,     &demonParry);
+    HasAttr(demon, ATTR_CURSE,     &curse);
+    HasAttr(demon, ATTR_DAMNATION, &damnation);
+    HasAttr(demon, ATTR_SNIPE,     &snipe);
+    if (HasAttr(demon, ATTR_RETALIATION, &counter))
+	numCountered = 2;
+    else if (HasAttr(demon, ATTR_COUNTERATTACK, &counter))
+	numCountered = 1;
+
+    for (round=1;round<=maxRounds;round++) {
+	if (hp <= 0 || (dealt == n && numHand == 0 && numField == 0))
+	    break;
+	if ((round & 1) == 0) {
+	    if (dealt < n && numHand < MAX_CARDS_IN_HAND) {
+		hand[numHand]  = (first + dealt++) % n;
+		ready[numHand] = round + d->cards[hand[numHand]].timing;
+		numHand++;
+	    }
+	    for (i=0,j=0;i<numHand;i++) {
+		const Card *c = &d->cards[hand[i]];
+		PlainCard  *p = &field[numField];
+
+		if (ready[i] > round || numField >= MAX_CARDS_IN_SET) {
+		    hand[j]  = hand[i];
+		    ready[j] = ready[i];
+		    j++;
+		    continue;
+		}
+		memset(p, 0, sizeof(*p));
+		p->atk = c->atk;
+		p->hp  = c->hp;
+		p->hit = 1;
+		if (HasAttr(c, ATTR_CONCENTRATE, &level))
+		    p->bonus += (double) c->curBaseAtk * level / 200;
+		if (HasAttr(c, ATTR_WARPATH, &level))
+		    p->bonus += (double) c->curBaseAtk * level / 100;
+		if (HasAttr(c, ATTR_BACKSTAB, &level))
+		    p->backstab = level;
+		HasAttr(c, ATTR_VENDETTA, &p->vendetta);
+		HasAttr(c, ATTR_BLOODTHIRSTY, &p->growth);
+		if (HasAttr(c, ATTR_DODGE, &level))
+		    p->hit = 1 - level / 100.0;
+		HasAttr(c, ATTR_PARRY, &p->parry);
+		numField++;
+	    }
+	    numHand = j;
+	    if (numField > 0 && round >= FIRST_PLAYER_ROUND) {
+		total += MAX(field[0].atk + field[0].bonus +
+			field[0].backstab + field[0].vendetta * numGrave -
+			demonParry, 0);
+		field[0].atk += field[0].growth;
+		for (i=0;i<numCountered && i<numField;i++)
+		    field[i].hp -= counter;
+	    }
+	    for (i=0;i<numField;i++)
+		field[i].backstab = 0;
+	} else if (round >= FIRST_DEMON_ROUND) {
+	    hp -= UnavoidableDamage(round) + curse + damnation * numField;
+	    if (snipe > 0 && numField > 0) {
+		for (i=1,j=0;i<numField;i++) {
+		    if (field[i].hp < field[j].hp)
+			j = i;
+		}
+		field[j].hp -= snipe;
+	    }
+	    if (numField == 0 || field[0].hp <= 0) {
+		hp -= demon->atk;
+	    } else {
+		field[0].hp -= MAX(demon->atk - field[0].parry, 0) *
+			       field[0].hit;
 	    }
 	}
+	for (i=0,j=0;i<numField;i++) {
+	    if (field[i].hp > 0)
+		field[j++] = field[i];
+	}
+	numGrave += numField - j;
+	numField  = j;
     }
-    if (doDebug || showDamage)
-	numThreads = 1;
+    *rounds = round - 1;
+    return total;
+}
+
+/**
+ * Works out the estimator features of a deck.  The plain fight is played
+ * once starting from each card of the deck, as a cheap stand-in for the
+ * random deck order, and averaged.
+ *
+ * @param	initial		The state the fights start from.
+ * @param	features	Gets NUM_EST_FEATURES features.
+ */
+static void EstimateFeatures(const State *initial, double *features)
+{
+    int n      = initial->deck.numCards;
+    int rounds = 0;
+    int i      = 0;
+
+    features[0] = 1;
+    features[1] = 0;
+    features[2] = 0;
+    for (i=0;i<n;i++) {
+	features[1] += PlainFight(initial, i, &rounds) / n;
+	features[2] += (double) rounds / n;
+    }
+}
+
+/**
+ * Fits the estimator weights to the calibration rows by least squares.  If
+ * there are too few rows for that, the plain fight damage is just scaled
+ * to match the simulated damage on average.
+ *
+ * @param	rows		The calibration rows.
+ * @param	numRows		The number of rows.
+ * @param	skip		A row to leave out, or -1.
+ * @param	demon		The demon to fit for.
+ * @param	weights		Gets NUM_EST_FEATURES weights.
+ */
+static void FitEstimator(const EstimateRow *rows, int numRows, int skip,
+	const char *demon, double *weights)
+{
+    double a[NUM_EST_FEATURES * NUM_EST_FEATURES];
+    double plain = 0;
+    double dmg   = 0;
+    int    used  = 0;
+    int    i     = 0;
+    int    j     = 0;
+    int    k     = 0;
+
+    for (i=0;i<numRows;i++) {
+	if (i != skip && !strcasecmp(rows[i].demon, demon))
+	    used++;
+    }
+    // Use all the demons if this one has too few rows for a fit.
+    if (used <= NUM_EST_FEATURES)
+	demon = NULL;
+    used = 0;
+    memset(a, 0, sizeof(a));
+    memset(weights, 0, NUM_EST_FEATURES * sizeof(double));
+    for (i=0;i<numRows;i++) {
+	const EstimateRow *row = &rows[i];
+
+	if (i == skip || (demon != NULL && strcasecmp(row->demon, demon)))
+	    continue;
+	used++;
+	for (j=0;j<NUM_EST_FEATURES;j++) {
+	    for (k=0;k<NUM_EST_FEATURES;k++)
+		a[j*NUM_EST_FEATURES+k] += row->features[j] * row->features[k];
+	    weights[j] += row->features[j] * row->dmg;
+	}
+	plain += row->features[1];
+	dmg   += row->dmg;
+    }
+    if (used > NUM_EST_FEATURES &&
+	    SolveLinear(a, weights, NUM_EST_FEATURES))
+	return;
+    memset(weights, 0, NUM_EST_FEATURES * sizeof(double));
+    weights[1] = (plain > 0) ? dmg / plain : 1;
+}
+
+/**
+ * Reads the calibration rows saved by -calibrate.  Each line has the plain
+ * fight damage, the plain fight rounds and the simulated damage, followed
+ * by the level, demon and deck for reference.
+ *
+ * @param	filename	The calibration file.
+ * @param	numRows		Gets the number of rows.
+ * @return			The rows (see FreeEstimateRows), or NULL if
+ *				the file can't be read.
+ */
+static EstimateRow *ReadEstimateRows(const char *filename, int *numRows)
+{
+    static char  buffer[MAX_LINE_SIZE];
+    FILE        *f       = fopen(filename, "r");
+    EstimateRow *rows    = NULL;
+    int          maxRows = 0;
+    char        *trimmed = NULL;
+
+    *numRows = 0;
+    if (f == NULL)
+	return NULL;
+    while (fgets(buffer, MAX_LINE_SIZE, f) != NULL) {
+	EstimateRow row;
+	char       *s = NULL;
+
+	buffer[MAX_LINE_SIZE-1] = '\0';
+	trimmed = trim(buffer);
+	if (trimmed[0] == '#' || trimmed[0] == '\0')
+	    continue;
+	row.features[0] = 1;
+	s = strtok(trimmed, ",");
+	row.features[1] = (s != NULL) ? strtod(s, NULL) : 0;
+	s = strtok(NULL, ",");
+	row.features[2] = (s != NULL) ? strtod(s, NULL) : 0;
+	s = strtok(NULL, ",");
+	if (s == NULL) {
+	    fprintf(stderr, "Error: Bad line in %s: %s\n", filename, trimmed);
+	    exit(1);
+	}
+	row.dmg = strtod(s, NULL);
+	s = strtok(NULL, ",");		// Level
+	s = strtok(NULL, ",");
+	row.demon = my_strdup((s != NULL) ? trim(s) : "");
+	if (*numRows >= maxRows) {
+	    maxRows = MAX(2 * maxRows, 64);
+	    rows    = (EstimateRow *) realloc(rows, maxRows * sizeof(*rows));
+	}
+	rows[(*numRows)++] = row;
+    }
+    fclose(f);
+    return rows;
+}
+
+/**
+ * Frees the rows read by ReadEstimateRows.
+ *
+ * @param	rows		The calibration rows.
+ * @param	numRows		The number of rows.
+ */
+static void FreeEstimateRows(EstimateRow *rows, int numRows)
+{
+    int i = 0;
+
+    for (i=0;i<numRows;i++)
+	free(rows[i].demon);
+    free(rows);
+}
+
+/**
+ * Prints the estimator's error over the calibration rows.  Each row is
+ * predicted with weights fitted to the other rows, so that the error is
+ * what to expect for a new deck.
+ *
+ * @param	rows		The calibration rows.
+ * @param	numRows		The number of rows.
+ */
+static void PrintEstimateError(const EstimateRow *rows, int numRows)
+{
+    double weights[NUM_EST_FEATURES];
+    double sumSq = 0;
+    double dmg   = 0;
+    int    i     = 0;
+    int    j     = 0;
+
+    if (numRows < 2) {
+	fprintf(output, "Estimator error               : unknown (calibrated "
+		"with %d deck%s)\n", numRows, numRows == 1 ? "" : "s");
+	return;
+    }
+    for (i=0;i<numRows;i++) {
+	double predicted = 0;
+
+	FitEstimator(rows, numRows, i, rows[i].demon, weights);
+	for (j=0;j<NUM_EST_FEATURES;j++)
+	    predicted += weights[j] * rows[i].features[j];
+	sumSq += (predicted - rows[i].dmg) * (predicted - rows[i].dmg);
+	dmg   += rows[i].dmg;
+    }
+    fprintf(output, "Estimator error               : %.1lf (%.1lf%%, "
+	    "%d decks)\n", sqrt(sumSq / numRows),
+	    (dmg > 0) ? sqrt(sumSq / numRows) * 100 * numRows / dmg : 0,
+	    numRows);
+}
+
+/**
+ * Estimates the average damage of the deck without simulating it (see
+ * EstimateRow).  This takes microseconds, so it can be used to weed out
+ * decks that are far from good enough before simulating the rest.
+ *
+ * @param	cost		The deck cost.
+ */
+static void RunEstimate(int cost)
+{
+    double       features[NUM_EST_FEATURES];
+    double       weights[NUM_EST_FEATURES];
+    double       dmg     = 0;
+    int          numRows = 0;
+    int          i       = 0;
+    EstimateRow *rows    = ReadEstimateRows(estimateFile, &numRows);
+
+    EstimateFeatures(&defaultState, features);
+    FitEstimator(rows, numRows, -1, theDemon, weights);
+    for (i=0;i<NUM_EST_FEATURES;i++)
+	dmg += weights[i] * features[i];
+    dmg = MAX(dmg, 0);
+
+    PrintDeck(cost);
+    fprintf(output, "Estimate (no simulation):\n\n");
+    fprintf(output, "Average dmg per fight         : %5.1lf\n", dmg);
+    fprintf(output, "Average dmg per minute        : %5.1lf\n",
+	    (dmg * 60) / (60 + cost * 2));
+    PrintEstimateError(rows, numRows);
+    fprintf(output, "\n\n");
+    FreeEstimateRows(rows, numRows);
+}
+
+/**
+ * Runs the simulation like normal, then adds the deck to the estimator's
+ * calibration file and shows how good the estimator is now.
+ *
+ * @param	cost		The deck cost.
+ */
+static void RunCalibrate(int cost)
+{
+    Result       result;
+    Task         batch;
+    double       features[NUM_EST_FEATURES];
+    int          numRows = 0;
+    EstimateRow *rows    = NULL;
+    FILE        *f       = NULL;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.initial       = &defaultState;
+    batch.numIterations = numIters;
+    RunFights(&batch, &result);
+
+    EstimateFeatures(&defaultState, features);
+    f = fopen(calibrateFile, "a");
+    if (f == NULL) {
+	fprintf(stderr, "Error: Couldn't write file %s.\n", calibrateFile);
+	exit(1);
+    }
+    fprintf(f, "%.1lf, %.1lf, %.1lf, %d, %s, %s\n", features[1], features[2],
+	    (double) result.total / numIters, initialLevel, theDemon,
+	    deckFile);
+    fclose(f);
+
+    PrintDeck(cost);
+    fprintf(output, "Results of simulation (%d fights):\n\n", numIters);
+    PrintResults(&result, numIters, cost);
+    rows = ReadEstimateRows(calibrateFile, &numRows);
+    PrintEstimateError(rows, numRows);
+    fprintf(output, "\n\n");
+    FreeEstimateRows(rows, numRows);
+}
+
+// The search of -enumerate.  The pool cards are sorted by their value (the
+// average dmg per card of a deck of only that card), and a deck is built in
+// pool order, so the cards that can still be added are never worth more
+// than the one being added.  Decks often do more than the sum of their
+// values, since cards help each other, so the sum is scaled by the largest
+// ratio of dmg to value seen so far, plus -boundslack percent.  That gives
+// an optimistic bound on each partial deck, and a whole subtree is skipped
+// when even the bound can't beat the best deck simulated so far.
+typedef struct enumDeck {
+    int		picks[MAX_CARDS_IN_DECK];	// Pool slots of the cards.
+    int		cost;
+    double	dmg;			// Average dmg per fight.
+    double	ci;			// Half width of 95% confidence interval.
+} EnumDeck;
+
+typedef struct enumContext {
+    int		numPool;
+    Card	pool[MAX_CANDIDATES + MAX_CARDS_IN_DECK];
+    double	value[MAX_CANDIDATES + MAX_CARDS_IN_DECK];
+    int		minCost[MAX_CANDIDATES + MAX_CARDS_IN_DECK];	// From the
+					// slot to the end of the pool.
+    int		picks[MAX_CARDS_IN_DECK];
+    State	deck;			// The deck being simulated.
+    int        *dmg;			// Dmg of each fight of that deck.
+    int        *bestDmg;		// Dmg of each fight of the best deck.
+    double	bestAvg;
+    bool	haveBest;
+    double	maxRatio;		// Largest dmg / value of a deck.
+    int		numTop;
+    EnumDeck	top[ENUM_TOP];
+    long long	numDecks;		// Complete decks reached.
+    long long	numPruned;		// Subtrees skipped by the bound.
+    long long	numDropped;		// Decks dropped part way.
+    long long	numFights;
+} EnumContext;
+
+/**
+ * Puts a pool of cards in the deck being simulated.
+ *
+ * @param	ctx		The search.
+ * @param	picks		The pool slots of the cards.
+ * @param	numCards	The number of cards.
+ */
+static void SetEnumDeck(EnumContext *ctx, const int *picks, int numCards)
+{
+    int i = 0;
+
+    ctx->deck.deck.numCards = 0;
+    for (i=0;i<numCards;i++)
+	AddCardToSet(&ctx->deck.deck, &ctx->pool[picks[i]]);
+}
+
+/**
+ * Simulates the complete deck in ctx->picks, a batch of fights at a time.
+ * Every deck uses the same fight seeds, so after each batch its fights can
+ * be compared one by one against the same fights of the best deck, and it
+ * is dropped as soon as it is clearly worse.  A deck that is not dropped
+ * gets the full number of fights and is added to the top decks.
+ *
+ * @param	ctx		The search.
+ * @param	cost		The deck cost.
+ * @param	value		The deck value.
+ */
+static void EvalEnumDeck(EnumContext *ctx, int cost, double value)
+{
+    Result   result;
+    Task     batch;
+    EnumDeck d;
+    double   dmg   = 0;
+    double   sum   = 0;
+    double   sumSq = 0;
+    double   var   = 0;
+    int     *tmp   = NULL;
+    int      done  = 0;
+    int      i     = 0;
+
+    ctx->numDecks++;
+    SetEnumDeck(ctx, ctx->picks, enumerateCards);
+    memset(&batch, 0, sizeof(batch));
+    batch.initial = &ctx->deck;
+    while (done < numIters) {
+	batch.firstFight    = done;
+	batch.numIterations = MIN(ENUM_BATCH, numIters - done);
+	batch.fightDmg      = &ctx->dmg[done];
+	RunFights(&batch, &result);
+	ctx->numFights += batch.numIterations;
+	for (i=done;i<done+batch.numIterations;i++) {
+	    double diff = ctx->haveBest ? ctx->dmg[i] - ctx->bestDmg[i] : 0;
+
+	    dmg   += ctx->dmg[i];
+	    sum   += diff;
+	    sumSq += diff * diff;
+	}
+	done += batch.numIterations;
+	// Three standard errors, since many decks are compared.
+	if (ctx->haveBest && done > 1 && done < numIters) {
+	    var = (sumSq - sum * sum / done) / (done - 1);
+	    if (sum / done + 3 * sqrt(MAX(var, 0) / done) < 0)
+		break;
+	}
+    }
+    if (value > 0)
+	ctx->maxRatio = MAX(ctx->maxRatio, dmg / done / value);
+    if (done < numIters) {
+	ctx->numDropped++;
+	return;
+    }
+
+    memcpy(d.picks, ctx->picks, sizeof(d.picks));
+    d.cost = cost;
+    sum    = 0;
+    sumSq  = 0;
+    for (i=0;i<numIters;i++) {
+	sum   += ctx->dmg[i];
+	sumSq += (double) ctx->dmg[i] * ctx->dmg[i];
+    }
+    d.dmg = sum / numIters;
+    var   = (numIters > 1) ? (sumSq - sum * d.dmg) / (numIters - 1) : 0;
+    d.ci  = 1.96 * sqrt(MAX(var, 0) / numIters);
+
+    // Keep the top decks sorted, best first.  A deck that is no better than
+    // the last one of a full list isn't kept.
+    if (ctx->numTop < ENUM_TOP || d.dmg > ctx->top[ENUM_TOP-1].dmg) {
+	for (i=MIN(ctx->numTop, ENUM_TOP-1);
+		i>0 && ctx->top[i-1].dmg < d.dmg;i--)
+	    ctx->top[i] = ctx->top[i-1];
+	ctx->top[i] = d;
+	ctx->numTop = MIN(ctx->numTop + 1, ENUM_TOP);
+    }
+    if (!ctx->haveBest || d.dmg > ctx->bestAvg) {
+	ctx->bestAvg  = d.dmg;
+	ctx->haveBest = true;
+	tmp           = ctx->bestDmg;
+	ctx->bestDmg  = ctx->dmg;
+	ctx->dmg      = tmp;
+    }
+}
+
+/**
+ * Adds the rest of the cards to a partial deck in every possible way.
+ * The cards are added in pool order, starting from a given slot.
+ *
+ * @param	ctx		The search.
+ * @param	numCards	The number of cards in the partial deck.
+ * @param	first		The first pool slot that can be added.
+ * @param	cost		The cost of the partial deck.
+ * @param	value		The value of the partial deck.
+ */
+static void EnumerateDecks(EnumContext *ctx, int numCards, int first,
+	int cost, double value)
+{
+    int left = enumerateCards - numCards;
+    int i    = 0;
+
+    if (left == 0) {
+	EvalEnumDeck(ctx, cost, value);
+	return;
+    }
+    for (i=first;i<ctx->numPool;i++) {
+	if (maxCost > 0 && cost + left * ctx->minCost[i] > maxCost)
+	    break;
+	if (maxCost > 0 &&
+		cost + ctx->pool[i].cost + (left-1) * ctx->minCost[i] > maxCost)
+	    continue;
+	// The best this subtree can do is to fill the deck with this card,
+	// and the later cards are worth even less.
+	if (ctx->haveBest && boundSlack >= 0 &&
+		(value + left * ctx->value[i]) * ctx->maxRatio *
+		(100 + boundSlack) / 100 < ctx->bestAvg) {
+	    ctx->numPruned++;
+	    break;
+	}
+	ctx->picks[numCards] = i;
+	EnumerateDecks(ctx, numCards + 1, i, cost + ctx->pool[i].cost,
+		value + ctx->value[i]);
+    }
+}
+
+// The card values, for CompareEnumCards.
+static const double *enumValues;
+
+/**
+ * Sort function for the pool of -enumerate (most valuable first).
+ */
+static int CompareEnumCards(const void *a, const void *b)
+{
+    double va = enumValues[*(const int *) a];
+    double vb = enumValues[*(const int *) b];
+
+    if (va > vb)
+	return -1;
+    if (va < vb)
+	return 1;
+    return *(const int *) a - *(const int *) b;
+}
+
+/**
+ * Finds the best decks of enumerateCards cards made from the cards of the
+ * deck and the candidate cards, keeping the runes of the deck (see
+ * EnumContext).  Cards can be used any number of times, and with -maxcost
+ * the decks can't cost more than that.
+ */
+static void RunEnumerate(void)
+{
+    EnumContext *ctx     = (EnumContext *) calloc(1, sizeof(EnumContext));
+    Result       result;
+    Task         batch;
+    Card        *cards   = NULL;
+    double      *values  = NULL;
+    int         *order   = NULL;
+    int          numCards = 0;
+    int          i       = 0;
+    int          j       = 0;
+
+    if (snapshotFile != NULL) {
+	fprintf(stderr, "Error: -enumerate can't be used with -snapshot.\n");
+	exit(1);
+    }
+    cards  = (Card *)   calloc(MAX_CANDIDATES + MAX_CARDS_IN_DECK,
+			       sizeof(Card));
+    values = (double *) calloc(MAX_CANDIDATES + MAX_CARDS_IN_DECK,
+			       sizeof(double));
+    order  = (int *)    calloc(MAX_CANDIDATES + MAX_CARDS_IN_DECK,
+			       sizeof(int));
+    for (i=0;i<defaultState.deck.numCards+numCandidates;i++) {
+	const Card *c = (i < defaultState.deck.numCards) ?
+		&defaultState.deck.cards[i] :
+		FindCard(theCandidates[i - defaultState.deck.numCards]);
+
+	if (c == NULL)
+	    continue;
+	for (j=0;j<numCards;j++) {
+	    if (cards[j].id == c->id)
+		break;
+	}
+	if (j < numCards)
+	    continue;
+	cards[numCards] = *c;
+	InitCard(&cards[numCards]);
+	numCards++;
+    }
+    if (numCards == 0) {
+	fprintf(stderr, "Error: No cards to enumerate.\n");
+	exit(1);
+    }
+
+    ctx->deck     = defaultState;
+    ctx->maxRatio = 1;
+    memset(&batch, 0, sizeof(batch));
+    batch.initial       = &ctx->deck;
+    batch.numIterations = MIN(ENUM_BATCH, numIters);
+    for (i=0;i<numCards;i++) {
+	ctx->deck.deck.numCards = 0;
+	for (j=0;j<enumerateCards;j++)
+	    AddCardToSet(&ctx->deck.deck, &cards[i]);
+	RunFights(&batch, &result);
+	ctx->numFights += batch.numIterations;
+	values[i] = (double) result.total / batch.numIterations /
+		    enumerateCards;
+	order[i]  = i;
+    }
+    enumValues = values;
+    qsort(order, numCards, sizeof(int), CompareEnumCards);
+    ctx->numPool = numCards;
+    for (i=0;i<numCards;i++) {
+	ctx->pool[i]  = cards[order[i]];
+	ctx->value[i] = values[order[i]];
+    }
+    for (i=numCards-1;i>=0;i--) {
+	ctx->minCost[i] = ctx->pool[i].cost;
+	if (i < numCards - 1)
+	    ctx->minCost[i] = MIN(ctx->minCost[i], ctx->minCost[i+1]);
+    }
+
+    ctx->dmg     = (int *) calloc(numIters, sizeof(int));
+    ctx->bestDmg = (int *) calloc(numIters, sizeof(int));
+    EnumerateDecks(ctx, 0, 0, 0, 0);
+
+    fprintf(output, "Demon: %s\n", defaultState.demon.name);
+    fprintf(output, "Decks: %d cards from %d (level %d, %d initial hp",
+	    enumerateCards, numCards, initialLevel, initialHp);
+    if (maxCost > 0)
+	fprintf(output, ", %d max cost", maxCost);
+    fprintf(output, ")\n\nRunes:\n\n");
+    for (i=0;i<defaultState.numRunes;i++)
+	fprintf(output, "%s\n", defaultState.runes[i].name);
+    fprintf(output, "\nEnumeration (up to %d fights per deck, seed %u):\n\n",
+	    numIters, runSeed);
+    fprintf(output, "Decks tried                   : %lld\n", ctx->numDecks);
+    fprintf(output, "Decks dropped early           : %lld\n",
+	    ctx->numDropped);
+    fprintf(output, "Subtrees skipped by the bound : %lld\n", ctx->numPruned);
+    fprintf(output, "Fights                        : %lld\n\n",
+	    ctx->numFights);
+    if (ctx->numTop == 0)
+	fprintf(output, "No deck fits in the max cost.\n");
+    for (i=0;i<ctx->numTop;i++) {
+	const EnumDeck *d = &ctx->top[i];
+
+	fprintf(output, "%2d) %5.1lf +/- %4.1lf dmg per fight, %5.1lf dmg per "
+		"minute, %d cost\n", i+1, d->dmg, d->ci,
+		(d->dmg * 60) / (60 + d->cost * 2), d->cost);
+	for (j=0;j<enumerateCards;j++) {
+	    int copies = 1;
+
+	    while (j+1 < enumerateCards && d->picks[j+1] == d->picks[j]) {
+		copies++;
+		j++;
+	    }
+	    fprintf(output, "      %dx %s\n", copies,
+		    ctx->pool[d->picks[j]].name);
+	}
+    }
+    fprintf(output, "\n\n");
+
+    free(ctx->bestDmg);
+    free(ctx->dmg);
+    free(order);
+    free(values);
+    free(cards);
+    free(ctx);
+}
+
+/**
+ * Gets the chance that two samples of the same distribution differ by at
+ * least a given Kolmogorov-Smirnov statistic, which is Q(lambda) =
+ * 2 * sum_k (-1)^(k-1) * exp(-2 k^2 lambda^2).
+ *
+ * @param	lambda		The statistic, scaled for the sample sizes.
+ * @return			The chance.
+ */
+static double KSProbability(double lambda)
+{
+    double sum  = 0;
+    double sign = 2;
+    double term = 0;
+    int    k    = 0;
+
+    // The sum converges very slowly here, and is 1 to many places.
+    if (lambda < 0.2)
+	return 1;
+    for (k=1;k<=100;k++) {
+	term  = sign * exp(-2 * k * k * lambda * lambda);
+	sum  += term;
+	sign  = -sign;
+	if (fabs(term) < 1e-12)
+	    break;
+    }
+    return MIN(MAX(sum, 0), 1);
+}
+
+/**
+ * Runs a two-sample Kolmogorov-Smirnov test, which finds the largest gap
+ * between the fractions of each sample that are at or below any value.
+ *
+ * @param	a		The first sample (gets sorted).
+ * @param	b		The second sample (gets sorted).
+ * @param	n		The size of each sample.
+ * @return			The chance of a gap this big if both samples
+ *				come from the same distribution.
+ */
+static double KSTest(int *a, int *b, int n)
+{
+    double gap = 0;
+    double ne  = n / 2.0;
+    int    i   = 0;
+    int    j   = 0;
+
+    qsort(a, n, sizeof(int), CompareInts);
+    qsort(b, n, sizeof(int), CompareInts);
+    while (i < n && j < n) {
+	int v = MIN(a[i], b[j]);
+
+	while (i < n && a[i] == v)
+	    i++;
+	while (j < n && b[j] == v)
+	    j++;
+	gap = MAX(gap, fabs((double) (i - j) / n));
+    }
+    return KSProbability((sqrt(ne) + 0.12 + 0.11 / sqrt(ne)) * gap);
+}
+
+/**
+ * Compares the means of two independent samples.
+ *
+ * @param	a		The first sample.
+ * @param	b		The second sample.
+ * @param	n		The size of each sample.
+ * @param	diff		Gets the mean of b minus the mean of a.
+ * @param	ci		Gets the half width of the 95% confidence
+ *				interval of the difference.
+ * @return			The chance of a difference this big if both
+ *				samples have the same mean.
+ */
+static double MeanTest(const int *a, const int *b, int n, double *diff,
+	double *ci)
+{
+    double sum[2]   = { 0, 0 };
+    double sumSq[2] = { 0, 0 };
+    double var      = 0;
+    double se       = 0;
+    int    i        = 0;
+
+    for (i=0;i<n;i++) {
+	sum[0]   += a[i];
+	sumSq[0] += (double) a[i] * a[i];
+	sum[1]   += b[i];
+	sumSq[1] += (double) b[i] * b[i];
+    }
+    *diff = (sum[1] - sum[0]) / n;
+    for (i=0;i<2 && n>1;i++)
+	var += MAX((sumSq[i] - sum[i] * sum[i] / n) / (n - 1), 0) / n;
+    se  = sqrt(var);
+    *ci = 1.96 * se;
+    if (se == 0)
+	return (*diff == 0) ? 1 : 0;
+    return erfc(fabs(*diff) / se / sqrt(2));
 }
 
-#define MAX_DEFAULT_ARGS	50
+/**
+ * Flips the switches given with -compare.  Flipping them twice puts them
+ * back.
+ */
+static void FlipSwitches(void)
+{
+    int i = 0;
+
+    for (i=0;i<NUM_SWITCHES;i++) {
+	if (compareFlip[i])
+	    *switchFlags[i] = !*switchFlags[i];
+    }
+}
 
 /**
- * Reads the defaults.txt file and handles command line arguments in that file.
+ * Checks that flipping the -compare switches doesn't change the results.
+ * For each demon and deck of the -corpus file (or just the given ones),
+ * the fights are run with the switches as given and then with them
+ * flipped, using different seeds, so that the two samples are
+ * independent.  The damage of the two samples is compared with a
+ * difference of means test and a Kolmogorov-Smirnov test, and the rounds
+ * with a Kolmogorov-Smirnov test.  A test fails when its chance is below
+ * COMPARE_ALPHA divided by the number of tests.
+ *
+ * @return			True if every test passed.
  */
-static void HandleDefaultArgs(void)
+static bool RunCompare(void)
 {
-    static char defaultArgs[MAX_LINE_SIZE];
-    char       *argArray[MAX_DEFAULT_ARGS];
-    FILE       *def     = NULL;
-    int         numArgs = 1;
-    char       *start   = NULL;
-    char       *s       = NULL;
+    Result result;
+    Task   batch;
+    int   *dmg[2];
+    int   *rounds[2];
+    int    numEntries = (numCorpus > 0) ? numCorpus : 1;
+    int    numTests   = 3 * numEntries;
+    int    numFailed  = 0;
+    double alpha      = COMPARE_ALPHA / numTests;
+    bool   flipped    = false;
+    int    i          = 0;
+    int    j          = 0;
+
+    if (numCorpus > 0 && snapshotFile != NULL) {
+	fprintf(stderr, "Error: -corpus can't be used with -snapshot.\n");
+	exit(1);
+    }
+    for (i=0;i<2;i++) {
+	dmg[i]    = (int *) calloc(numIters, sizeof(int));
+	rounds[i] = (int *) calloc(numIters, sizeof(int));
+    }
 
-    def = fopen("defaults.txt", "r");
-    if (def == NULL)
-	return;
-    if (fgets(defaultArgs, MAX_LINE_SIZE, def) != NULL) {
-	start = trim(defaultArgs);
+    fprintf(output, "Comparison of engines (%d fights each, seed %u):\n\n",
+	    numIters, runSeed);
+    fprintf(output, "Flipped:");
+    for (j=0;j<NUM_SWITCHES;j++) {
+	if (compareFlip[j]) {
+	    fprintf(output, " -%s (%s)", switchNames[j],
+		    *switchFlags[j] ? "off" : "on");
+	    flipped = true;
+	}
+    }
+    if (!flipped)
+	fprintf(output, " nothing (only the seeds differ)");
+    fprintf(output, "\n\nDemon        Deck               Old dmg   New dmg"
+	    "  Difference (95%% CI)  p means   p dmg  p rounds\n");
+    for (i=0;i<numEntries;i++) {
+	double pMeans  = 0;
+	double pDmg    = 0;
+	double pRounds = 0;
+	double diff    = 0;
+	double ci      = 0;
+	double oldAvg  = 0;
+	int    failed  = 0;
+
+	if (numCorpus > 0) {
+	    theDemon = theCorpusDemons[i];
+	    deckFile = theCorpusDecks[i];
+	    readDeckFromFile(deckFile);
+	    InitDefaultState(&defaultState);
+	    InitDemonProfile(&defaultState.demon);
+	}
+	memset(&batch, 0, sizeof(batch));
+	batch.initial       = &defaultState;
+	batch.numIterations = numIters;
+	for (j=0;j<2;j++) {
+	    batch.firstFight  = j * numIters;
+	    batch.fightDmg    = dmg[j];
+	    batch.fightRounds = rounds[j];
+	    RunFights(&batch, &result);
+	    if (j == 0)
+		oldAvg = (double) result.total / numIters;
+	    FlipSwitches();
+	}
 
-	do {
-	    s = strchr(start, ' ');
-	    if (s != NULL) {
-		argArray[numArgs++] = start;
-		*s = '\0';
-		start = trim(s+1);
-	    } else {
-		argArray[numArgs++] = start;
-		break;
+	pMeans  = MeanTest(dmg[0], dmg[1], numIters, &diff, &ci);
+	pDmg    = KSTest(dmg[0], dmg[1], numIters);
+	pRounds = KSTest(rounds[0], rounds[1], numIters);
+	failed  = (pMeans < alpha) + (pDmg < alpha) + (pRounds < alpha);
+	numFailed += failed;
+	fprintf(output, "%-12s %-16s %9.1lf %9.1lf  %+8.1lf +/- %6.1lf  "
+		"%7.4lf %7.4lf  %7.4lf%s\n", defaultState.demon.name,
+		deckFile, oldAvg, oldAvg + diff, diff, ci, pMeans, pDmg,
+		pRounds, failed ? "  DIFFERENT" : "");
+    }
+
+    fprintf(output, "\n");
+    if (numFailed == 0) {
+	fprintf(output, "All %d tests passed (each needs p >= %.6lf).\n",
+		numTests, alpha);
+    } else {
+	fprintf(output, "%d of %d tests failed (each needs p >= %.6lf).\n",
+		numFailed, numTests, alpha);
+    }
+    fprintf(output, "\n\n");
+
+    for (i=0;i<2;i++) {
+	free(dmg[i]);
+	free(rounds[i]);
+    }
+    return numFailed == 0;
+}
+
+/**
+ * Runs the simulation with variance reduction.
+ *
+ * With -antithetic, the fights are run in pairs where the second fight of
+ * each pair uses the opposite random numbers of the first (a dodge that
+ * succeeded in one fails in the other, and so on).  The pair average has a
+ * lower variance than the average of two independent fights whenever the
+ * two fights are negatively correlated.
+ *
+ * With -controlvariates, the average damage is corrected using the
+ * rollExcess totals of each fight (how much luckier than expected the fight
+ * was on each kind of roll, see Chance()).  Those totals have an expected
+ * value of exactly 0, so subtracting their best linear fit from the damage
+ * leaves the expected damage unchanged but removes the part of the variance
+ * caused by luck on those rolls.  Quantities such as the number of rounds or
+ * the -avgconcentrate result of the same fight are also correlated with the
+ * damage, but their expected values are unknown, so they can't be used.
+ *
+ * @param	cost		The deck cost.
+ */
+static void RunVarianceReduction(int cost)
+{
+    Result  result;
+    Task    batch;
+    int     n         = numIters;
+    int     numUnits  = 0;
+    int     unitSize  = doAntithetic ? 2 : 1;
+    int    *fightDmg  = NULL;
+    int    *controls  = NULL;
+    double *y         = NULL;
+    double *x         = NULL;
+    double  sumY      = 0;
+    double  sumYY     = 0;
+    double  mean      = 0;
+    double  adjusted  = 0;
+    double  seUnit    = 0;
+    double  seAdj     = 0;
+    double  sePlain   = 0;
+    int     used[NUM_ROLL_TYPES];
+    int     numUsed   = 0;
+    double  xMean[NUM_ROLL_TYPES];
+    double  sxx[NUM_ROLL_TYPES * NUM_ROLL_TYPES];
+    double  sxy[NUM_ROLL_TYPES];
+    int     i         = 0;
+    int     j         = 0;
+    int     k         = 0;
+
+    // Antithetic pairs need an even number of fights.
+    if (doAntithetic && (n & 1))
+	n++;
+    numUnits = n / unitSize;
+
+    fightDmg = (int *) calloc(n, sizeof(int));
+    controls = (int *) calloc((size_t) n * NUM_ROLL_TYPES, sizeof(int));
+    y        = (double *) calloc(numUnits, sizeof(double));
+    x        = (double *) calloc((size_t) numUnits * NUM_ROLL_TYPES,
+				 sizeof(double));
+
+    memset(&batch, 0, sizeof(batch));
+    batch.initial       = &defaultState;
+    batch.numIterations = n;
+    batch.antithetic    = doAntithetic;
+    batch.fightDmg      = fightDmg;
+    batch.fightControls = controls;
+    RunFights(&batch, &result);
+
+    // The independent units are single fights or antithetic pairs.
+    for (i=0;i<numUnits;i++) {
+	for (j=0;j<unitSize;j++) {
+	    int f = i * unitSize + j;
+
+	    y[i] += (double) fightDmg[f] / unitSize;
+	    for (k=0;k<NUM_ROLL_TYPES;k++) {
+		x[i*NUM_ROLL_TYPES+k] +=
+		    (double) controls[f*NUM_ROLL_TYPES+k] / unitSize;
 	    }
-	} while(numArgs < MAX_DEFAULT_ARGS);
+	}
+	sumY  += y[i];
+	sumYY += y[i] * y[i];
+    }
+    mean = sumY / numUnits;
+    if (numUnits > 1)
+	seUnit = sqrt(MAX((sumYY - sumY * mean) / (numUnits - 1), 0) /
+		      numUnits);
+    adjusted = mean;
+    seAdj    = seUnit;
+
+    // Estimate what the standard error would be with plain fights.
+    for (i=0, sumY=0, sumYY=0;i<n;i++) {
+	sumY  += fightDmg[i];
+	sumYY += (double) fightDmg[i] * fightDmg[i];
+    }
+    if (n > 1)
+	sePlain = sqrt(MAX((sumYY - sumY * sumY / n) / (n - 1), 0) / n);
+
+    if (doControlVariates) {
+	// Only use the controls that vary (i.e. that have rolls).
+	for (k=0;k<NUM_ROLL_TYPES;k++) {
+	    xMean[k] = 0;
+	    for (i=0;i<numUnits;i++)
+		xMean[k] += x[i*NUM_ROLL_TYPES+k];
+	    xMean[k] /= numUnits;
+	    for (i=0;i<numUnits;i++) {
+		if (x[i*NUM_ROLL_TYPES+k] != xMean[k])
+		    break;
+	    }
+	    if (i < numUnits)
+		used[numUsed++] = k;
+	}
 
-	if (numArgs > 1)
-	    HandleArgs(numArgs, argArray);
+	// Least squares fit of damage to the controls.
+	memset(sxx, 0, sizeof(sxx));
+	memset(sxy, 0, sizeof(sxy));
+	for (i=0;i<numUnits;i++) {
+	    for (j=0;j<numUsed;j++) {
+		double dj = x[i*NUM_ROLL_TYPES+used[j]] - xMean[used[j]];
+
+		sxy[j] += dj * (y[i] - mean);
+		for (k=0;k<numUsed;k++) {
+		    sxx[j*numUsed+k] += dj *
+			(x[i*NUM_ROLL_TYPES+used[k]] - xMean[used[k]]);
+		}
+	    }
+	}
+	if (numUsed > 0 && numUnits > numUsed + 1 &&
+		SolveLinear(sxx, sxy, numUsed)) {
+	    double sumRes = 0;
+
+	    // The controls have a known mean of 0.
+	    adjusted = mean;
+	    for (j=0;j<numUsed;j++)
+		adjusted -= sxy[j] * xMean[used[j]];
+	    for (i=0;i<numUnits;i++) {
+		double res = y[i] - mean;
+
+		for (j=0;j<numUsed;j++) {
+		    res -= sxy[j] *
+			(x[i*NUM_ROLL_TYPES+used[j]] - xMean[used[j]]);
+		}
+		sumRes += res * res;
+	    }
+	    seAdj = sqrt(sumRes / (numUnits - numUsed - 1) / numUnits);
+	} else {
+	    numUsed = 0;
+	}
     }
-    fclose(def);
+
+    PrintDeck(cost);
+    fprintf(output, "Results of simulation (%d fights%s):\n\n", n,
+	    doAntithetic ? " in antithetic pairs" : "");
+    // Report the corrected average in place of the plain one.
+    result.total = (long long) (adjusted * n + 0.5);
+    PrintResults(&result, n, cost);
+    fprintf(output, "Variance reduction:\n\n");
+    fprintf(output, "Plain average dmg per fight   : %5.1lf\n", mean);
+    fprintf(output, "Standard error (plain)        : %5.2lf (estimated)\n",
+	    sePlain);
+    if (doAntithetic) {
+	fprintf(output, "Standard error (antithetic)   : %5.2lf\n", seUnit);
+    }
+    if (doControlVariates) {
+	fprintf(output, "Standard error (controls)     : %5.2lf (%d control%s)"
+		"\n", seAdj, numUsed, numUsed == 1 ? "" : "s");
+    }
+    fprintf(output, "\n\n");
+
+    free(x);
+    free(y);
+    free(controls);
+    free(fightDmg);
 }
 
+#if !defined(USING_WINDOWS) && !defined(SIM_COMPILED)
 /**
- * The entrypoint for one thread.  This will run the specified number of
- * simulations, and put the results in the given Task structure.
+ * Builds a copy of the simulator specialized for the current deck, demon
+ * and candidates, and runs it in place of this one (see -compile).  The
+ * generated source includes sim.c with the list of abilities that can
+ * appear in the fights (see compiledAttrs), so the compiler removes the
+ * code for all the others.  The shared object is named after a hash of the
+ * generated source and of sim.c, so it is only built once.
  *
- * @param	arg		A Task structure holding the State and the
- *				number of iterations to run.  The results
- *				will also be placed in the Task.
+ * @param	argc		The command line argument count.
+ * @param	argv		The command line arguments.
+ * @param	exitCode	Gets the exit code of the compiled simulator.
+ * @return			False if the compiled simulator couldn't be
+ *				built or loaded.  A message is printed and
+ *				the normal engine should be used instead.
  */
-#if defined(USING_WINDOWS)
-static DWORD WINAPI ThreadSimulate(LPVOID arg)
-#else
-static void *ThreadSimulate(void *arg)
-#endif
+static bool RunCompiled(int argc, char *argv[], int *exitCode)
 {
-    Task     *task          = (Task *) arg;
-    State    *state         = task->state;
-    int       numIterations = task->numIterations;
-    Result   *result        = task->result;
-    int       i             = 0;
-    long long total         = 0;
-    long long totalRounds   = 0;
-    int       lowRounds     = 0x7fffffff;
-    int       highRounds    = 0;
-    int       lowDamage     = 0x7fffffff;
-    int       highDamage    = 0;
-    int       localRoundX   = roundX;
-    int       timesRoundX   = 0;
-    bool      hitRoundX     = false;
+    static char        gen[MAX_LINE_SIZE];
+    static char        cmd[MAX_LINE_SIZE];
+    char               srcName[64];
+    char               soName[64];
+    unsigned char      used[NUM_ATTR_TYPES];
+    const CardSet     *sets[4];
+    const char        *failed  = NULL;
+    const char        *cc      = getenv("CC");
+    unsigned char     *src     = NULL;
+    unsigned long long hash    = 0;
+    void              *so      = NULL;
+    int              (*entry)(int, char **) = NULL;
+    FILE              *f       = NULL;
+    long               srcLen  = 0;
+    int                len     = 0;
+    int                i       = 0;
+    int                j       = 0;
+    int                rc      = 0;
+
+    // Every attribute that isn't an ability that can be put in the cards
+    // file (buffs, runes, etc) is kept.
+    memset(used, 1, sizeof(used));
+    for (i=0;i<DIM(allAttrs);i++) {
+	if (allAttrs[i].attrType != ATTR_NONE &&
+		allAttrs[i].attrType != ATTR_DEAD)
+	    used[allAttrs[i].attrType] = 0;
+    }
+    sets[0] = &defaultState.deck;
+    sets[1] = &defaultState.hand;
+    sets[2] = &defaultState.field;
+    sets[3] = &defaultState.grave;
+    for (i=0;i<4;i++) {
+	for (j=0;j<sets[i]->numCards;j++) {
+	    const Card *c = &sets[i]->cards[j];
+	    int         k = 0;
+
+	    for (k=0;k<c->numAttr;k++)
+		used[c->attr[k].type] = 1;
+	}
+    }
+    for (i=0;i<defaultState.demon.numAttr;i++)
+	used[defaultState.demon.attr[i].type] = 1;
+    for (i=0;i<numCandidates;i++) {
+	const Card *c = FindCard(theCandidates[i]);
 
-    for (i=0;i<numIterations;i++) {
-	InitState(state);
-	ShuffleSet(state, &state->deck);
-	hitRoundX = false;
-	Simulate(state, localRoundX, &hitRoundX);
-	if (hitRoundX)
-	    timesRoundX++;
-	total       += state->dmgDone;
-	totalRounds += state->round;
-	highDamage = MAX(highDamage, state->dmgDone);
-	lowDamage  = MIN(lowDamage,  state->dmgDone);
-	highRounds = MAX(highRounds, state->round);
-	lowRounds  = MIN(lowRounds,  state->round);
-	if (showDamage) {
-	    fprintf(output, "Dmg done = %d\n", state->dmgDone);
+	for (j=0;c != NULL && j<c->numBaseAttr;j++)
+	    used[c->baseAttr[j].type] = 1;
+    }
+    // -compare replaces the demon and deck with each one in the corpus, so
+    // their abilities are kept too.  Reading a corpus deck replaces the
+    // deck file's cards, which are read again afterwards.
+    for (i=0;i<numCorpus;i++) {
+	const Card *c = FindCard(theCorpusDemons[i]);
+
+	for (j=0;c != NULL && j<c->numBaseAttr;j++)
+	    used[c->baseAttr[j].type] = 1;
+	readDeckFromFile(theCorpusDecks[i]);
+	for (j=0;j<numDeckCards;j++) {
+	    int k = 0;
+
+	    c = FindCard(theDeck[j]);
+	    for (k=0;c != NULL && k<c->numBaseAttr;k++)
+		used[c->baseAttr[k].type] = 1;
 	}
-	dprintf("\n");
     }
-    result->total       = total;
-    result->totalRounds = totalRounds;
-    result->highDamage  = highDamage;
-    result->lowDamage   = lowDamage;
-    result->highRounds  = highRounds;
-    result->lowRounds   = lowRounds;
-    result->timesRoundX = timesRoundX;
+    if (numCorpus > 0)
+	readDeckFromFile(deckFile);
+
+    len = snprintf(gen, sizeof(gen),
+	    "/* Generated by sim -compile for demon %s.  Do not edit. */\n"
+	    "#define SIM_COMPILED\n"
+	    "#define COMPILED_NUM_ATTR_TYPES %d\n"
+	    "#define COMPILED_ATTRS { \\\n   ", defaultState.demon.name,
+	    NUM_ATTR_TYPES);
+    for (i=0;i<NUM_ATTR_TYPES;i++) {
+	len += snprintf(&gen[len], sizeof(gen) - len, " %d,%s", used[i],
+		(i % 20 == 19) ? " \\\n   " : "");
+    }
+    len += snprintf(&gen[len], sizeof(gen) - len, " }\n#include \"sim.c\"\n");
 
-#if defined(USING_WINDOWS)
-    return 0;
-#else
-    return NULL;
-#endif
+    // Read sim.c, so that a new version gets a new shared object.
+    f = fopen("sim.c", "rb");
+    if (f == NULL) {
+	failed = "sim.c isn't in the current directory";
+	goto Done;
+    }
+    fseek(f, 0, SEEK_END);
+    srcLen = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (srcLen < 0) {
+	fclose(f);
+	failed = "the size of sim.c couldn't be found";
+	goto Done;
+    }
+    src = (unsigned char *) malloc(srcLen + 1);
+    if (src == NULL) {
+	fclose(f);
+	failed = "there isn't enough memory to read sim.c";
+	goto Done;
+    }
+    if (fread(src, 1, srcLen, f) != (size_t) srcLen) {
+	fclose(f);
+	failed = "sim.c couldn't be read";
+	goto Done;
+    }
+    fclose(f);
+    hash = HashBytes((const unsigned char *) gen, len) ^
+	   (HashBytes(src, srcLen) * 31);
+    snprintf(srcName, sizeof(srcName), "simc_%016llx.c",  hash);
+    snprintf(soName,  sizeof(soName),  "./simc_%016llx.so", hash);
+
+    f = fopen(soName, "rb");
+    if (f != NULL) {
+	fclose(f);
+    } else {
+	f = fopen(srcName, "w");
+	if (f == NULL) {
+	    failed = "the generated source couldn't be written";
+	    goto Done;
+	}
+	fputs(gen, f);
+	fclose(f);
+	snprintf(cmd, sizeof(cmd), "%s -O3 -march=native -shared -fPIC "
+		"-fvisibility=hidden -pthread -o %s %s -lm",
+		cc != NULL ? cc : "cc", soName, srcName);
+	fprintf(stderr, "Compiling: %s\n", cmd);
+	rc = system(cmd);
+	remove(srcName);
+	if (rc != 0) {
+	    remove(soName);
+	    failed = "the compiler failed";
+	    goto Done;
+	}
+    }
+
+    so = dlopen(soName, RTLD_NOW | RTLD_LOCAL);
+    if (so == NULL) {
+	failed = "the shared object couldn't be loaded";
+	goto Done;
+    }
+    *(void **) &entry = dlsym(so, "SimCompiledMain");
+    if (entry == NULL) {
+	failed = "the shared object has no entry point";
+	goto Done;
+    }
+
+    // The compiled simulator opens the output file again.
+    if (output != stdout) {
+	fclose(output);
+	output = stdout;
+    }
+    fflush(stdout);
+    *exitCode = entry(argc, argv);
+    fflush(stdout);
+
+Done:
+    free(src);
+    if (failed != NULL) {
+	fprintf(output, "Compiled engine not possible because %s.\n"
+		"Using the normal engine instead.\n\n", failed);
+	return false;
+    }
+    return true;
 }
+#endif
 
 /**
  * Main function.  Reads info from various files, starts up multiple
  * threads, and then runs the simulation on those threads.  Once all the
  * threads are done, this function will gather the results and print them out.
  */
+#if defined(SIM_COMPILED)
+// The compiled simulator is a shared object, run by RunCompiled().
+__attribute__((visibility("default")))
+int SimCompiledMain(int argc, char *argv[])
+#else
 int main(int argc, char *argv[])
+#endif
 {
-    int         i           = 0;
     int         cost        = 0;
-    int         deckTime    = 0;
-    long long   total       = 0;
-    double      dTotal      = 0;
-    long long   totalRounds = 0;
-    int         lowRounds   = 0x7fffffff;
-    int         highRounds  = 0;
-    int         lowDamage   = 0x7fffffff;
-    int         highDamage  = 0;
-    int         timesRoundX = 0;
-    Result     *results     = NULL;
-    Task       *tasks       = NULL;
-#if defined(USING_WINDOWS)
-    HANDLE     *threads     = NULL;
-#else
-    pthread_t  *threads     = NULL;
-#endif
+    int         exitCode    = 0;
+    Result      result;
+    Task        batch;
 
     output = stdout;
     readCardTypesFromFile("cards.txt");
@@ -3452,7 +9135,55 @@ int main(int argc, char *argv[])
     initialHp = hpPerLevel[initialLevel];
 
     HandleDefaultArgs();
+    // Only the real command line overrides a snapshot.
+    haveHp    = false;
+    haveDemon = false;
     HandleArgs(argc, argv);
+    // These modes run their fights without the -tilt weights, or are
+    // dropped by RunTilt.
+    if (doTilt && (doSensitivity || doExact || doSolve || enumerateCards > 0 ||
+		doCompare || doFork || doAntithetic || doControlVariates ||
+		stratifyCards > 0 || calibrateFile != NULL)) {
+	fprintf(stderr, "Error: -tilt can't be used with -sensitivity, "
+		"-exact, -solve, -enumerate,\n-compare, -fork, -antithetic, "
+		"-controlvariates, -stratify or -calibrate.\n");
+	exit(1);
+    }
+    // RunVarianceReduction doesn't stratify its fights.
+    if ((doAntithetic || doControlVariates) && stratifyCards > 0) {
+	fprintf(stderr, "Error: -antithetic and -controlvariates can't be "
+		"used with -stratify.\n");
+	exit(1);
+    }
+    // RunFork doesn't pair, correct or stratify its fights.
+    if (doFork && (doAntithetic || doControlVariates || stratifyCards > 0)) {
+	fprintf(stderr, "Error: -fork can't be used with -antithetic, "
+		"-controlvariates or -stratify.\n");
+	exit(1);
+    }
+    // The calibration row is only written from a normal run.
+    if (calibrateFile != NULL && (estimateFile != NULL || saveRound > 0 ||
+		doSensitivity || doExact || doSolve || enumerateCards > 0 ||
+		doCompare || doTilt || doFork || doAntithetic ||
+		doControlVariates || stratifyCards > 0)) {
+	fprintf(stderr, "Error: -calibrate can't be used with -estimate, "
+		"-saveround, -sensitivity, -exact,\n-solve, -enumerate, "
+		"-compare, -tilt, -fork, -antithetic, -controlvariates or\n"
+		"-stratify.\n");
+	exit(1);
+    }
+    // The window projection is only made from a normal run.
+    if (windowMinutes > 0 && (estimateFile != NULL || saveRound > 0 ||
+		doSensitivity || doExact || doSolve || enumerateCards > 0 ||
+		doCompare || doTilt || doFork || doAntithetic ||
+		doControlVariates || stratifyCards > 0 ||
+		calibrateFile != NULL)) {
+	fprintf(stderr, "Error: -window can't be used with -estimate, "
+		"-saveround, -sensitivity, -exact,\n-solve, -enumerate, "
+		"-compare, -tilt, -fork, -antithetic, -controlvariates,\n"
+		"-stratify or -calibrate.\n");
+	exit(1);
+    }
 
     if (outputFilename != NULL) {
 	if (doAppend)
@@ -3465,101 +9196,133 @@ int main(int argc, char *argv[])
 	}
     }
     readDeckFromFile(deckFile);
+    if (candidatesFile != NULL)
+	readCandidatesFromFile(candidatesFile);
+    if (corpusFile != NULL)
+	readCorpusFromFile(corpusFile);
 
-    cost     = CalcCost();
-    deckTime = 60 + cost*2;
-
-    srand(time(NULL));
+    if (!haveSeed)
+	runSeed = (unsigned int) time(NULL);
 
     InitDefaultState(&defaultState);
+    if (snapshotFile != NULL)
+	readSnapshotFromFile(&defaultState, snapshotFile);
+    InitDemonProfile(&defaultState.demon);
 
-    AllocateStates(numThreads);
-    for (i=0;i<numThreads;i++) {
-	states[i]->seedW = rand();
-	states[i]->seedZ = rand();
-    }
-
-    results = (Result *)    calloc(numThreads, sizeof(Result));
-    tasks   = (Task *)      calloc(numThreads, sizeof(Task));
+#if !defined(SIM_COMPILED)
+    if (doCompile) {
 #if defined(USING_WINDOWS)
-    threads = (HANDLE *)    calloc(numThreads, sizeof(HANDLE));
+	fprintf(output, "Compiled engine not possible on Windows.\n"
+		"Using the normal engine instead.\n\n");
 #else
-    threads = (pthread_t *) calloc(numThreads, sizeof(pthread_t));
+	if (RunCompiled(argc, argv, &exitCode))
+	    return exitCode;
+#endif
+    }
 #endif
 
-    // Start all threads running.
-    for (i=0;i<numThreads;i++) {
-	int numIterations = numIters / numThreads;
+    cost = CalcCost(&defaultState);
 
-	// Make the first thread also do all the remainder # of iters.
-	if (i == 0)
-	    numIterations += (numIters - numIterations * numThreads);
-	tasks[i].state         = states[i];
-	tasks[i].numIterations = numIterations;
-	tasks[i].result        = &results[i];
-#if defined(USING_WINDOWS)
-	threads[i] = CreateThread(NULL, 0, ThreadSimulate, (LPVOID) &tasks[i],
-			0, NULL);
-#else
-	pthread_create(&threads[i], NULL, ThreadSimulate, (void *) &tasks[i]);
-#endif
+    if (estimateFile != NULL) {
+	RunEstimate(cost);
+	if (output != stdout)
+	    fclose(output);
+	return 0;
     }
 
-    // Wait for all threads to complete.
-    for (i=0;i<numThreads;i++) {
-#if defined(USING_WINDOWS)
-	WaitForSingleObject(threads[i], INFINITE);
-#else
-	void *dummyRet;
+    AllocateStates(numThreads);
 
-	pthread_join(threads[i], &dummyRet);
-#endif
+    if (saveRound > 0) {
+	SaveRound();
+	if (output != stdout)
+	    fclose(output);
+	return 0;
     }
 
-    // Total the results from all threads.
-    for (i=0;i<numThreads;i++) {
-	total       += results[i].total;
-	totalRounds += results[i].totalRounds;
-	timesRoundX += results[i].timesRoundX;
-	highDamage   = MAX(highDamage, results[i].highDamage);
-	lowDamage    = MIN(lowDamage,  results[i].lowDamage);
-	highRounds   = MAX(highRounds, results[i].highRounds);
-	lowRounds    = MIN(lowRounds,  results[i].lowRounds);
+    if (doSensitivity) {
+	PrintDeck(cost);
+	RunSensitivity();
+	if (output != stdout)
+	    fclose(output);
+	return 0;
     }
 
-    fprintf(output, "Demon: %s\n", theDemon);
-    fprintf(output,
-	    "Deck : (level %d, %d initial hp, %d cost, "
-	    "%d:%02d cooldown)\n\n",
-	    initialLevel, initialHp, cost,
-	    deckTime / 60, deckTime % 60);
-    for (i=0;i<defaultState.deck.numCards;i++)
-	fprintf(output, "%2d) %s\n", i+1, defaultState.deck.cards[i].name);
-    fprintf(output, "\nRunes:\n\n");
-    for (i=0;i<defaultState.numRunes;i++)
-	fprintf(output, "%s\n", defaultState.runes[i].name);
-    fprintf(output, "\nResults of simulation (%d fights):\n\n", numIters);
-#if 0
-    fprintf(output, "Total dmg over %d runs: %lld\n",
-	    numIters, (long long) total);
-#endif
-    dTotal = (double) total / numIters;
-    fprintf(output, "Lowest  number of rounds      : %d\n"
-	            "Highest number of rounds      : %d\n"
-		    "Average number of rounds      : %4.1lf\n",
-		    lowRounds, highRounds, (double) totalRounds / numIters);
-    if (timesRoundX > 0) {
-	fprintf(output, "Percent time hitting round %d : %4.1lf\n",
-		roundX, ((double) timesRoundX * 100.0f / numIters));
+    if (doExact && RunExact(cost)) {
+	if (output != stdout)
+	    fclose(output);
+	return 0;
     }
-    fprintf(output, "\n");
-    fprintf(output, "Lowest  damage                : %d\n"
-		    "Highest damage                : %d\n"
-	            "Average dmg per fight         : %5.1lf\n",
-		    lowDamage, highDamage, dTotal);
-    fprintf(output, "Average dmg per minute        : %5.1lf\n",
-	    (dTotal * 60) / (60 + cost * 2));
-    fprintf(output, "\n\n");
+
+    if (doSolve && RunSolve(cost)) {
+	if (output != stdout)
+	    fclose(output);
+	return 0;
+    }
+
+    if (enumerateCards > 0) {
+	RunEnumerate();
+	if (output != stdout)
+	    fclose(output);
+	return 0;
+    }
+
+    if (doCompare) {
+	exitCode = RunCompare() ? 0 : 1;
+	if (output != stdout)
+	    fclose(output);
+	return exitCode;
+    }
+
+    if (doTilt) {
+	RunTilt(cost);
+	if (output != stdout)
+	    fclose(output);
+	return 0;
+    }
+
+    if (doFork) {
+	RunFork(cost);
+	if (output != stdout)
+	    fclose(output);
+	return 0;
+    }
+
+    if (doAntithetic || doControlVariates) {
+	RunVarianceReduction(cost);
+	if (output != stdout)
+	    fclose(output);
+	return 0;
+    }
+
+    if (stratifyCards > 0) {
+	RunStratified(cost);
+	if (output != stdout)
+	    fclose(output);
+	return 0;
+    }
+
+    if (calibrateFile != NULL) {
+	RunCalibrate(cost);
+	if (output != stdout)
+	    fclose(output);
+	return 0;
+    }
+
+    if (windowMinutes > 0) {
+	RunWindow(cost);
+	if (output != stdout)
+	    fclose(output);
+	return 0;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    batch.initial       = &defaultState;
+    batch.numIterations = numIters;
+    RunFights(&batch, &result);
+
+    PrintDeck(cost);
+    fprintf(output, "Results of simulation (%d fights):\n\n", numIters);
+    PrintResults(&result, numIters, cost);
     if (output != stdout)
 	fclose(output);
     return 0;